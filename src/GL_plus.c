@@ -1,8 +1,10 @@
 #include "GL_plus.h"
 
 
+#include <SDL.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 
 const char * glEnumToString(GLenum e) {
@@ -34,7 +36,60 @@ const char * glEnumToString(GLenum e) {
 }
 
 
+/* The callback can run on a driver thread, so everything it shares
+   with the rest of the engine is atomic. The file and line are set
+   separately, and can tear, which only costs a misleading location. */
+static SDL_atomic_t debug_output_enabled;
+static SDL_atomic_t reported_error_count;
+static const char * checkpoint_file = "(no check yet)";
+static SDL_atomic_t checkpoint_line;
+
+
+static void GLAPIENTRY report(GLenum source,
+                              GLenum type,
+                              GLuint id,
+                              GLenum severity,
+                              GLsizei length,
+                              const GLchar * message,
+                              const void * user) {
+    if (type == GL_DEBUG_TYPE_ERROR) {
+        SDL_AtomicAdd(&reported_error_count, 1);
+    }
+    printf("%s : %d and after : %s\n",
+           (const char *)SDL_AtomicGetPtr((void **)&checkpoint_file),
+           SDL_AtomicGet(&checkpoint_line),
+           message);
+}
+
+
+int glEnableDebugOutput(void) {
+    if (!GLEW_KHR_debug) {
+        return 0;
+    }
+
+    glEnable(GL_DEBUG_OUTPUT);
+    glDebugMessageCallback(report, NULL);
+    /* Notifications are mostly the driver narrating buffer usage */
+    glDebugMessageControl(GL_DONT_CARE,
+                          GL_DONT_CARE,
+                          GL_DEBUG_SEVERITY_NOTIFICATION,
+                          0, NULL,
+                          GL_FALSE);
+
+    /* Anything from before now still has to be polled for */
+    glLogErrorsAtLocation(__FILE__, __LINE__);
+    SDL_AtomicSet(&debug_output_enabled, 1);
+    return 1;
+}
+
+
 int glLogErrorsAtLocation(const char * f, int l) {
+    if (SDL_AtomicGet(&debug_output_enabled)) {
+        SDL_AtomicSetPtr((void **)&checkpoint_file, (void *)f);
+        SDL_AtomicSet(&checkpoint_line, l);
+        return SDL_AtomicSet(&reported_error_count, 0);
+    }
+
     GLenum e;
     int count = 0;
     while ((e = glGetError()) != GL_NO_ERROR) {
@@ -116,3 +171,330 @@ void glBindUniformBlock(GLuint program,
         glUniformBlockBinding(program, index, uniformBlockBinding);
     }
 }
+
+
+#define SHADOWED_CAP_COUNT 5
+#define SHADOWED_TEXTURE_UNIT_COUNT 16
+
+
+static const GLenum shadowed_caps[SHADOWED_CAP_COUNT] = {
+    GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_SCISSOR_TEST, GL_STENCIL_TEST,
+};
+
+
+/* Filling this with 0xFF bytes leaves every field holding a value no
+   real call will ever pass, so the next call always goes through */
+static struct {
+    GLboolean caps[SHADOWED_CAP_COUNT];
+    GLenum cull_face;
+    GLenum front_face;
+    GLfloat clear_color[4];
+    GLboolean color_mask[4];
+    GLboolean depth_mask;
+    GLenum depth_func;
+    GLenum stencil_func;
+    GLint stencil_ref;
+    GLuint stencil_mask;
+    GLenum stencil_op[3];
+    GLint viewport[4];
+
+    GLuint program;
+    GLenum active_texture;
+    GLuint textures[SHADOWED_TEXTURE_UNIT_COUNT];
+    GLuint framebuffer;
+    GLuint vertex_array;
+    GLuint array_buffer;
+    GLuint uniform_buffer;
+} shadow;
+
+
+static struct GLStateCounters counters;
+
+
+void glsInvalidate(void) {
+    memset(&shadow, 0xFF, sizeof(shadow));
+}
+
+
+static int shadowed_cap_index(GLenum cap) {
+    for (int i = 0; i < SHADOWED_CAP_COUNT; i++) {
+        if (shadowed_caps[i] == cap) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static void set_cap(GLenum cap, GLboolean enabled) {
+    int i = shadowed_cap_index(cap);
+    if (i >= 0 && shadow.caps[i] == enabled) {
+        counters.skipped++;
+        return;
+    }
+    if (i >= 0) {
+        shadow.caps[i] = enabled;
+    }
+
+    counters.changes++;
+    if (enabled) {
+        glEnable(cap);
+    } else {
+        glDisable(cap);
+    }
+}
+
+
+void glsEnable(GLenum cap) {
+    set_cap(cap, GL_TRUE);
+}
+
+
+void glsDisable(GLenum cap) {
+    set_cap(cap, GL_FALSE);
+}
+
+
+void glsCullFace(GLenum mode) {
+    if (shadow.cull_face == mode) {
+        counters.skipped++;
+        return;
+    }
+    shadow.cull_face = mode;
+    counters.changes++;
+    glCullFace(mode);
+}
+
+
+void glsFrontFace(GLenum mode) {
+    if (shadow.front_face == mode) {
+        counters.skipped++;
+        return;
+    }
+    shadow.front_face = mode;
+    counters.changes++;
+    glFrontFace(mode);
+}
+
+
+void glsClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+    GLfloat color[4] = { r, g, b, a };
+    if (memcmp(shadow.clear_color, color, sizeof(color)) == 0) {
+        counters.skipped++;
+        return;
+    }
+    memcpy(shadow.clear_color, color, sizeof(color));
+    counters.changes++;
+    glClearColor(r, g, b, a);
+}
+
+
+void glsColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a) {
+    GLboolean mask[4] = { r, g, b, a };
+    if (memcmp(shadow.color_mask, mask, sizeof(mask)) == 0) {
+        counters.skipped++;
+        return;
+    }
+    memcpy(shadow.color_mask, mask, sizeof(mask));
+    counters.changes++;
+    glColorMask(r, g, b, a);
+}
+
+
+void glsDepthMask(GLboolean flag) {
+    if (shadow.depth_mask == flag) {
+        counters.skipped++;
+        return;
+    }
+    shadow.depth_mask = flag;
+    counters.changes++;
+    glDepthMask(flag);
+}
+
+
+void glsDepthFunc(GLenum func) {
+    if (shadow.depth_func == func) {
+        counters.skipped++;
+        return;
+    }
+    shadow.depth_func = func;
+    counters.changes++;
+    glDepthFunc(func);
+}
+
+
+void glsStencilFunc(GLenum func, GLint ref, GLuint mask) {
+    if (shadow.stencil_func == func
+        && shadow.stencil_ref == ref
+        && shadow.stencil_mask == mask) {
+        counters.skipped++;
+        return;
+    }
+    shadow.stencil_func = func;
+    shadow.stencil_ref = ref;
+    shadow.stencil_mask = mask;
+    counters.changes++;
+    glStencilFunc(func, ref, mask);
+}
+
+
+void glsStencilOp(GLenum sfail, GLenum dpfail, GLenum dppass) {
+    if (shadow.stencil_op[0] == sfail
+        && shadow.stencil_op[1] == dpfail
+        && shadow.stencil_op[2] == dppass) {
+        counters.skipped++;
+        return;
+    }
+    shadow.stencil_op[0] = sfail;
+    shadow.stencil_op[1] = dpfail;
+    shadow.stencil_op[2] = dppass;
+    counters.changes++;
+    glStencilOp(sfail, dpfail, dppass);
+}
+
+
+void glsViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+    GLint viewport[4] = { x, y, width, height };
+    if (memcmp(shadow.viewport, viewport, sizeof(viewport)) == 0) {
+        counters.skipped++;
+        return;
+    }
+    memcpy(shadow.viewport, viewport, sizeof(viewport));
+    counters.changes++;
+    glViewport(x, y, width, height);
+}
+
+
+void glsUseProgram(GLuint program) {
+    if (shadow.program == program) {
+        counters.skipped++;
+        return;
+    }
+    shadow.program = program;
+    counters.binds++;
+    glUseProgram(program);
+}
+
+
+void glsActiveTexture(GLenum texture) {
+    if (shadow.active_texture == texture) {
+        counters.skipped++;
+        return;
+    }
+    shadow.active_texture = texture;
+    counters.changes++;
+    glActiveTexture(texture);
+}
+
+
+void glsBindTexture(GLenum target, GLuint texture) {
+    /* Only 2D bindings are shadowed, and only once we know the unit */
+    GLuint unit = shadow.active_texture - GL_TEXTURE0;
+    GLuint * bound = NULL;
+    if (target == GL_TEXTURE_2D && unit < SHADOWED_TEXTURE_UNIT_COUNT) {
+        bound = &shadow.textures[unit];
+    }
+
+    if (bound && *bound == texture) {
+        counters.skipped++;
+        return;
+    }
+    if (bound) {
+        *bound = texture;
+    }
+    counters.binds++;
+    glBindTexture(target, texture);
+}
+
+
+void glsBindFramebuffer(GLenum target, GLuint framebuffer) {
+    if (target == GL_FRAMEBUFFER && shadow.framebuffer == framebuffer) {
+        counters.skipped++;
+        return;
+    }
+    /* Binding just one of the draw or read targets splits them, and
+       then there's no single binding left to remember */
+    shadow.framebuffer = (target == GL_FRAMEBUFFER) ? framebuffer : (GLuint)-1;
+    counters.binds++;
+    glBindFramebuffer(target, framebuffer);
+}
+
+
+void glsBindVertexArray(GLuint array) {
+    if (shadow.vertex_array == array) {
+        counters.skipped++;
+        return;
+    }
+    shadow.vertex_array = array;
+    counters.binds++;
+    glBindVertexArray(array);
+}
+
+
+static GLuint * shadowed_buffer(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER:
+        return &shadow.array_buffer;
+    case GL_UNIFORM_BUFFER:
+        return &shadow.uniform_buffer;
+    default:
+        return NULL;
+    }
+}
+
+
+void glsBindBuffer(GLenum target, GLuint buffer) {
+    GLuint * bound = shadowed_buffer(target);
+    if (bound && *bound == buffer) {
+        counters.skipped++;
+        return;
+    }
+    if (bound) {
+        *bound = buffer;
+    }
+    counters.binds++;
+    glBindBuffer(target, buffer);
+}
+
+
+void glsBindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+    /* This also binds the buffer to the target's generic binding */
+    GLuint * bound = shadowed_buffer(target);
+    if (bound) {
+        *bound = buffer;
+    }
+    counters.binds++;
+    glBindBufferBase(target, index, buffer);
+}
+
+
+/* Deleting a bound object reverts its binding to zero, and the name
+   can be handed out again, so the shadow has to forget it */
+void glsDeleteBuffers(GLsizei n, const GLuint * buffers) {
+    for (GLsizei i = 0; i < n; i++) {
+        if (shadow.array_buffer == buffers[i]) {
+            shadow.array_buffer = 0;
+        }
+        if (shadow.uniform_buffer == buffers[i]) {
+            shadow.uniform_buffer = 0;
+        }
+    }
+    glDeleteBuffers(n, buffers);
+}
+
+
+void glsDeleteVertexArrays(GLsizei n, const GLuint * arrays) {
+    for (GLsizei i = 0; i < n; i++) {
+        if (shadow.vertex_array == arrays[i]) {
+            shadow.vertex_array = 0;
+        }
+    }
+    glDeleteVertexArrays(n, arrays);
+}
+
+
+struct GLStateCounters glsTakeCounters(void) {
+    struct GLStateCounters taken = counters;
+    counters = (struct GLStateCounters) { 0 };
+    return taken;
+}
@@ -9,7 +9,17 @@ int glLogErrorsAtLocation(const char * file, int line);
 int glLogErrorsAtLocationAndAssert(const char * file, int line);
 
 
-#ifdef STRICT
+/* Has the driver report errors through a callback, if it supports
+   KHR_debug. From then on glLogErrors no longer polls glGetError,
+   and only marks where it was called from so errors reported later
+   can say which check they came after. */
+int glEnableDebugOutput(void);
+
+
+/* Release builds don't check for errors at all */
+#if !defined(DEBUG)
+#define glLogErrors() ((void)0)
+#elif defined(STRICT)
 #define glLogErrors() glLogErrorsAtLocationAndAssert(__FILE__, __LINE__)
 #else
 #define glLogErrors() glLogErrorsAtLocation(__FILE__, __LINE__)
@@ -34,3 +44,44 @@ struct UniformBuffer {
     const GLuint bind;
     GLuint id;
 };
+
+
+/* Every state change and bind the engine makes goes through these,
+   which keep a shadow copy of the context's state and drop calls
+   that wouldn't change anything. They assume a single context,
+   current on one thread at a time. */
+void glsInvalidate(void);
+
+void glsEnable(GLenum cap);
+void glsDisable(GLenum cap);
+void glsCullFace(GLenum mode);
+void glsFrontFace(GLenum mode);
+void glsClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+void glsColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a);
+void glsDepthMask(GLboolean flag);
+void glsDepthFunc(GLenum func);
+void glsStencilFunc(GLenum func, GLint ref, GLuint mask);
+void glsStencilOp(GLenum sfail, GLenum dpfail, GLenum dppass);
+void glsViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+
+void glsUseProgram(GLuint program);
+void glsActiveTexture(GLenum texture);
+void glsBindTexture(GLenum target, GLuint texture);
+void glsBindFramebuffer(GLenum target, GLuint framebuffer);
+void glsBindVertexArray(GLuint array);
+void glsBindBuffer(GLenum target, GLuint buffer);
+void glsBindBufferBase(GLenum target, GLuint index, GLuint buffer);
+
+void glsDeleteBuffers(GLsizei n, const GLuint * buffers);
+void glsDeleteVertexArrays(GLsizei n, const GLuint * arrays);
+
+
+struct GLStateCounters {
+    GLuint changes;
+    GLuint binds;
+    GLuint skipped;
+};
+
+
+/* Returns the counts since the last call and starts counting again */
+struct GLStateCounters glsTakeCounters(void);
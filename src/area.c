@@ -2,19 +2,38 @@
 
 
 #include "events.h"
+#include "framebuffer.h"
 #include "immediate.h"
 #include "logger.h"
 #include "mathematics.h"
+#include "navigation.h"
+#include "random.h"
 #include "retained.h"
 #include "SDL_plus.h"
 #include "stdlib_plus.h"
 #include "string.h"
+#include "workers.h"
 
 
 GLuint64 SCENERY_VERTEX_ARRAY;
+/* TODO Improve this */
+/* Why didn't my solid object work? */
+/* Y value should be greater, I think */
+/* One unit wide, and stretched to each portal's width when drawn */
+static const union Vector3 portal_quad[4] = {
+    { .x=-0.5, .y=0.2, .z=0 },
+    { .x= 0.5, .y=0.2, .z=0 },
+    { .x=-0.5, .y=0.2, .z=3.2 },
+    { .x= 0.5, .y=0.2, .z=3.2 },
+};
 static GLuint64 portal_mesh;
+static GLuint64 impostor_mesh;
+static GLuint64 agent_inside_mesh;
+static GLuint64 agent_outside_mesh;
 static GLuint lit_program;
 static GLuint stencil_program;
+static GLuint impostor_program;
+#define IMPOSTOR_TEXTURE_UNIT 1
 
 
 enum Continue CreateAreaMeshes(void) {
@@ -22,19 +41,43 @@ enum Continue CreateAreaMeshes(void) {
 
     rtBindVertexArray(SCENERY_VERTEX_ARRAY);
     rtBegin(); {
-	/* TODO Improve this */
-	/* Why didn't my solid object work? */
-	/* Y value should be greater, I think */
-	imVertex3f(-1, 0.2, 0);
-	imVertex3f( 1, 0.2, 0);
-	imVertex3f(-1, 0.2, 3.2);
-	imVertex3f( 1, 0.2, 3.2);
+	imVertices3(4, portal_quad);
     } portal_mesh = rtEnd();
 
+    /* The same quad, with the whole of a texture stretched across it */
+    rtBegin(); {
+	for (int i=0; i<4; ++i) {
+	    imTexCoord2f(i % 2, i / 2);
+	    imVertex3(portal_quad[i]);
+	}
+    } impostor_mesh = rtEnd();
+
+    /* A unit diamond, scaled up to the agent's radius when drawn */
+    const union Vector3 diamond[8] = {
+	{ .x=0, .y=1 }, { .x=1, .y=0 },
+	{ .x=1, .y=0 }, { .x=0, .y=-1 },
+	{ .x=0, .y=-1 }, { .x=-1, .y=0 },
+	{ .x=-1, .y=0 }, { .x=0, .y=1 },
+    };
+    imColor3ub(0, 255, 255);
+    rtBegin(); {
+	imVertices3(8, diamond);
+    } agent_inside_mesh = rtEnd();
+    imColor3ub(255, 127, 0);
+    rtBegin(); {
+	imVertices3(8, diamond);
+    } agent_outside_mesh = rtEnd();
+
     lit_program = LoadProgram(FromBase("assets/shaders/vertex_lighting.vert"),
 			      FromBase("assets/shaders/textured_vertex_color.frag"));
     stencil_program = LoadProgram(FromBase("assets/shaders/world_space.vert"),
 				  FromBase("assets/shaders/vertex_color.frag"));
+    /* Impostors sample their own texture unit, so whatever scenery
+       samples stays bound */
+    impostor_program = LoadProgram(FromBase("assets/shaders/world_space.vert"),
+				   FromBase("assets/shaders/textured.frag"));
+    glsUseProgram(impostor_program);
+    glUniform1i(glGetUniformLocation(impostor_program, "uni_texture"), IMPOSTOR_TEXTURE_UNIT);
 
     return UP;
 }
@@ -47,6 +90,10 @@ static int is_invalid(Area area) {
 }
 
 
+static int cull_portals;
+static void bake_visibility(Area id);
+
+
 Area LoadArea(const char* filepath) {
     if (area_count == MAX_BASE_AREA_COUNT) {
 	Warn("Trying to load too many areas!\n");
@@ -76,6 +123,10 @@ Area LoadArea(const char* filepath) {
 	LoadNetwork(id, FromBase(network_filepath));
     }
 
+    if (cull_portals) {
+	bake_visibility(id);
+    }
+
     {
 	char scenery_filepath[256] = { 0 };
 	strcpy(scenery_filepath, filepath);
@@ -88,36 +139,36 @@ Area LoadArea(const char* filepath) {
 
 
 static u16 instance_count = 0;
+static bool instance_is_live[MAX_INSTANCED_AREA_COUNT];
+static u16 instance_occupants[MAX_INSTANCED_AREA_COUNT];
 static Area instances[MAX_INSTANCED_AREA_COUNT];
 
 
 static Area instance_area(u16 base) {
-    Area id = { .base=base, .instance=instance_count++ };
-    instances[id.instance] = id;
-    InstanceNetwork(id);
-    return id;
-}
-
+    /* Instances are retired as the player walks away from them, so
+       reuse the first free slot rather than appending */
+    for (u16 index=0; index<MAX_INSTANCED_AREA_COUNT; index++) {
+	if (!instance_is_live[index]) {
+	    Area id = { .base=base, .instance=index };
+	    instances[index] = id;
+	    instance_is_live[index] = TRUE;
+	    instance_occupants[index] = 0;
+	    instance_count++;
+	    InstanceNetwork(id);
+	    return id;
+	}
+    }
 
-Area InstanceArea(const Area area) {
-    return instance_area(area.base);
+    return INVALID_AREA;
 }
 
 
-void InstanceAreas(int count) {
-    count = (MAX_INSTANCED_AREA_COUNT < count) ? MAX_INSTANCED_AREA_COUNT : count;
-    Log("Making %d places using %d bases\n", count, area_count);
-
-    int i = 0;
-    /* Ensure each area is instanced at least once */
-    /* for (; i<count && i<area_count; i++) { */
-	/* instance_area(i); */
-    /* } */
-
-    /* Randomly instance areas until count is reached */
-    for (; i<count; i++) {
-	instance_area(i % area_count);
+Area InstanceArea(const Area area) {
+    Area id = instance_area(area.base);
+    if (is_invalid(id)) {
+	Warn("Trying to instance too many areas!\n");
     }
+    return id;
 }
 
 
@@ -202,16 +253,239 @@ struct Cell {
 };
 
 
-#define MAX_CELL_COUNT 64
+/* Point location goes through a uniform grid laid over the
+   navmesh's bounds. Each bucket lists the cells whose bounding boxes
+   overlap it, so a query only tests a handful of triangles. */
+#define NAVMESH_GRID_SIZE 8
+#define NAVMESH_BUCKET_COUNT (NAVMESH_GRID_SIZE * NAVMESH_GRID_SIZE)
+#define MAX_NAVMESH_BUCKET_ENTRY_COUNT (MAX_CELL_COUNT * NAVMESH_BUCKET_COUNT)
+
+
+/* Collision works from the cells' edges as lines, kept apart from the
+   cells themselves and laid out a field at a time. Edge `e` of cell
+   `c` is at `c * 3 + e`, and its normal points into the cell. */
+#define MAX_EDGE_COUNT (MAX_CELL_COUNT * 3)
+
+
+struct Edges {
+    float normals_x[MAX_EDGE_COUNT], normals_y[MAX_EDGE_COUNT];
+    float offsets[MAX_EDGE_COUNT];
+    u8 connected_to[MAX_EDGE_COUNT];
+    u8 connection_index[MAX_EDGE_COUNT];
+};
+
+
 struct Navmesh {
     int cell_count;
     struct Cell cells[MAX_CELL_COUNT];
+    struct Edges edges;
+
+    /* Six GL_LINES vertices per cell, in cell order */
+    GLuint64 outline_mesh;
+    GLuint64 highlight_mesh;
+
+    /* A bit per portal that might be seen from somewhere in the cell */
+    u8 visible_portals[MAX_CELL_COUNT];
+
+    union Vector2 grid_origin;
+    union Vector2 grid_scale;
+    u16 bucket_starts[NAVMESH_BUCKET_COUNT + 1];
+    u8 bucket_cells[MAX_NAVMESH_BUCKET_ENTRY_COUNT];
 };
 
 
 static struct Navmesh navmeshes[MAX_BASE_AREA_COUNT];
 
 
+static void cell_bounds(struct Cell* cell, union Vector2* min, union Vector2* max) {
+    union Triangle3 t = cell->triangle;
+    *min = Vector2(fminf(t.a.x, fminf(t.b.x, t.c.x)), fminf(t.a.y, fminf(t.b.y, t.c.y)));
+    *max = Vector2(fmaxf(t.a.x, fmaxf(t.b.x, t.c.x)), fmaxf(t.a.y, fmaxf(t.b.y, t.c.y)));
+}
+
+
+static int to_bucket(float f, float origin, float scale) {
+    int i = (int)((f - origin) * scale);
+    return (i < 0) ? 0 : (i >= NAVMESH_GRID_SIZE) ? NAVMESH_GRID_SIZE - 1 : i;
+}
+
+
+static void index_navmesh(struct Navmesh* navmesh) {
+    if (navmesh->cell_count == 0) {
+	return;
+    }
+
+    union Vector2 min, max;
+    cell_bounds(&navmesh->cells[0], &min, &max);
+    for (int i=1; i<navmesh->cell_count; i++) {
+	union Vector2 cell_min, cell_max;
+	cell_bounds(&navmesh->cells[i], &cell_min, &cell_max);
+	min = Vector2(fminf(min.x, cell_min.x), fminf(min.y, cell_min.y));
+	max = Vector2(fmaxf(max.x, cell_max.x), fmaxf(max.y, cell_max.y));
+    }
+
+    navmesh->grid_origin = min;
+    navmesh->grid_scale = Vector2(NAVMESH_GRID_SIZE / fmaxf(max.x - min.x, 0.001f),
+				  NAVMESH_GRID_SIZE / fmaxf(max.y - min.y, 0.001f));
+
+    /* Count how many cells land in each bucket, turn the counts into
+       offsets, then fill the buckets in */
+    u16 counts[NAVMESH_BUCKET_COUNT] = { 0 };
+    for (int pass=0; pass<2; pass++) {
+	for (int i=0; i<navmesh->cell_count; i++) {
+	    union Vector2 cell_min, cell_max;
+	    cell_bounds(&navmesh->cells[i], &cell_min, &cell_max);
+	    int x0 = to_bucket(cell_min.x, navmesh->grid_origin.x, navmesh->grid_scale.x);
+	    int x1 = to_bucket(cell_max.x, navmesh->grid_origin.x, navmesh->grid_scale.x);
+	    int y0 = to_bucket(cell_min.y, navmesh->grid_origin.y, navmesh->grid_scale.y);
+	    int y1 = to_bucket(cell_max.y, navmesh->grid_origin.y, navmesh->grid_scale.y);
+	    for (int y=y0; y<=y1; y++) {
+		for (int x=x0; x<=x1; x++) {
+		    int bucket = y * NAVMESH_GRID_SIZE + x;
+		    if (pass == 0) {
+			counts[bucket]++;
+		    } else {
+			navmesh->bucket_cells[navmesh->bucket_starts[bucket] + counts[bucket]++] = i;
+		    }
+		}
+	    }
+	}
+
+	if (pass == 0) {
+	    navmesh->bucket_starts[0] = 0;
+	    for (int bucket=0; bucket<NAVMESH_BUCKET_COUNT; bucket++) {
+		navmesh->bucket_starts[bucket + 1] = navmesh->bucket_starts[bucket] + counts[bucket];
+		counts[bucket] = 0;
+	    }
+	}
+    }
+}
+
+
+static void prepare_edges(struct Navmesh* navmesh) {
+    struct Edges* edges = &navmesh->edges;
+    for (int i=0; i<navmesh->cell_count; i++) {
+	struct Cell* cell = &navmesh->cells[i];
+	for (int edge_index=0; edge_index<3; edge_index++) {
+	    union Vector2 a = cell->triangle.p[edge_index].xy;
+	    union Vector2 b = cell->triangle.p[(edge_index + 1) % 3].xy;
+	    union Vector2 c = cell->triangle.p[(edge_index + 2) % 3].xy;
+
+	    /* Cells may be wound either way, so flip the normal towards
+	       the opposite corner if need be */
+	    union Vector2 normal = Normalize2(Vector2(-(b.y - a.y), b.x - a.x));
+	    if (Dot2(normal, Sub2(c, a)) < 0) {
+		normal = Negate2(normal);
+	    }
+
+	    int e = i * 3 + edge_index;
+	    edges->normals_x[e] = normal.x;
+	    edges->normals_y[e] = normal.y;
+	    edges->offsets[e] = Dot2(normal, a);
+	    edges->connected_to[e] = cell->connected_to[edge_index];
+	    edges->connection_index[e] = cell->connection_index[edge_index];
+	}
+    }
+}
+
+
+static int inside_cell(struct Cell* cell, union Vector2 p) {
+    /* Cells may be wound either way, so accept the point if it's on
+       the same side of all three edges */
+    union Vector2 a = cell->triangle.a.xy, b = cell->triangle.b.xy, c = cell->triangle.c.xy;
+    float d0 = (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+    float d1 = (c.x - b.x) * (p.y - b.y) - (c.y - b.y) * (p.x - b.x);
+    float d2 = (a.x - c.x) * (p.y - c.y) - (a.y - c.y) * (p.x - c.x);
+    int has_negative = (d0 < 0) || (d1 < 0) || (d2 < 0);
+    int has_positive = (d0 > 0) || (d1 > 0) || (d2 > 0);
+    return !(has_negative && has_positive);
+}
+
+
+static int locate_cell(struct Navmesh* navmesh, union Vector2 point) {
+    if (navmesh->cell_count == 0) {
+	return -1;
+    }
+
+    float fx = (point.x - navmesh->grid_origin.x) * navmesh->grid_scale.x;
+    float fy = (point.y - navmesh->grid_origin.y) * navmesh->grid_scale.y;
+    if (fx < 0 || fy < 0 || fx >= NAVMESH_GRID_SIZE + 0.001f || fy >= NAVMESH_GRID_SIZE + 0.001f) {
+	return -1;
+    }
+
+    int bucket = to_bucket(point.y, navmesh->grid_origin.y, navmesh->grid_scale.y) * NAVMESH_GRID_SIZE
+	+ to_bucket(point.x, navmesh->grid_origin.x, navmesh->grid_scale.x);
+    for (int i=navmesh->bucket_starts[bucket]; i<navmesh->bucket_starts[bucket + 1]; i++) {
+	int cell_index = navmesh->bucket_cells[i];
+	if (inside_cell(&navmesh->cells[cell_index], point)) {
+	    return cell_index;
+	}
+    }
+
+    return -1;
+}
+
+
+/* Find the cell containing `point`, or -1 if it's off the navmesh.
+   Only the x and y coordinates are considered, so where cells overlap
+   the first one found wins. */
+int LocateCell(Area id, union Vector2 point) {
+    return locate_cell(&navmeshes[id.base], point);
+}
+
+
+/* Picks a point evenly over the navmesh by throwing darts at its
+   bounds and locating where they land. Should they all miss, it makes
+   do with the middle of a random cell. Returns the cell it's in. */
+#define MAX_DART_COUNT 16
+
+
+static int random_point(struct Navmesh* navmesh, struct Random* random, union Vector2* point) {
+    for (int dart=0; dart<MAX_DART_COUNT; dart++) {
+	*point = Vector2(navmesh->grid_origin.x + RandomFloat(random) * NAVMESH_GRID_SIZE / navmesh->grid_scale.x,
+			 navmesh->grid_origin.y + RandomFloat(random) * NAVMESH_GRID_SIZE / navmesh->grid_scale.y);
+	int cell_index = locate_cell(navmesh, *point);
+	if (cell_index != -1) {
+	    return cell_index;
+	}
+    }
+
+    int cell_index = RandomBelow(random, navmesh->cell_count);
+    union Triangle3 triangle = navmesh->cells[cell_index].triangle;
+    *point = Vector2((triangle.a.x + triangle.b.x + triangle.c.x) / 3.0f,
+		     (triangle.a.y + triangle.b.y + triangle.c.y) / 3.0f);
+    return cell_index;
+}
+
+
+union Vector2 GetRandomNavmeshPoint(Area id, struct Random* random) {
+    union Vector2 point = Vector2(0, 0);
+    if (navmeshes[id.base].cell_count) {
+	random_point(&navmeshes[id.base], random, &point);
+    }
+    return point;
+}
+
+
+/* Outlines never change, so they're recorded once into whichever
+   vertex array is bound while the area loads */
+static GLuint64 bake_navmesh_outline(const struct Navmesh* navmesh) {
+    rtBegin(); {
+	for (int i=0; i<navmesh->cell_count; ++i) {
+	    union Triangle3 t = navmesh->cells[i].triangle;
+	    const union Vector3 segments[6] = { t.a, t.b, t.b, t.c, t.c, t.a };
+	    imVertices3(6, segments);
+	}
+    } return rtEnd();
+}
+
+
+static GLuint64 get_cell_outline(GLuint64 mesh, int cell_index) {
+    GLuint64 first = (mesh >> 32) + 6 * (GLuint64)cell_index;
+    return (first << 32) | 6;
+}
+
+
 void LoadNavmesh(Area id, const char* filepath) {
     char* source = fopenstr(filepath);
     if (!source) {
@@ -252,45 +526,56 @@ void LoadNavmesh(Area id, const char* filepath) {
     }
     
     free(source);
+
+    prepare_edges(navmesh);
+    index_navmesh(navmesh);
+
+    imColor3ub(100, 50, 0);
+    navmesh->outline_mesh = bake_navmesh_outline(navmesh);
+    imColor3ub(255, 255, 0);
+    navmesh->highlight_mesh = bake_navmesh_outline(navmesh);
 }
 
 
 void DrawNavmesh(Area id) {
-    struct Navmesh* navmesh = &navmeshes[id.base];
+    rtBindVertexArray(SCENERY_VERTEX_ARRAY);
     imModel(Matrix4(1));
-    imColor3ub(100, 50, 0);
-    for (int i=0; i<navmesh->cell_count; ++i) {
-	union Triangle3 triangle = navmesh->cells[i].triangle;
-	imBegin(GL_LINE_LOOP); {
-	    imVertex3(triangle.a);
-	    imVertex3(triangle.b);
-	    imVertex3(triangle.c);
-	} imEnd();
-    }
+    rtDrawArrays(GL_LINES, navmeshes[id.base].outline_mesh);
 };
 
 
+/* Portal geometry never changes between instances of an area, so
+   it's only stored once per base area */
 struct Portal {
     int width;
-    int portal_index;
-    Area destination;
     union Matrix4 transform_out;
     union Matrix4 transform_in;
     int cell_index;
 };
 
 
-#define MAX_PORTAL_COUNT 8
+static union Matrix4 get_portal_model(struct Portal* portal, union Matrix4 transform) {
+    return MulM4(transform, Scale(Vector3(portal->width, 1, 1)));
+}
 
 
 struct Network {
     int portal_count;
     struct Portal portals[MAX_PORTAL_COUNT];
+    GLuint64 outline_mesh;
+
+    /* A bit per portal that might be seen looking in through a portal */
+    u8 visible_through[MAX_PORTAL_COUNT];
 };
 
 
-static struct Network base_networks[MAX_BASE_AREA_COUNT];
-static struct Network instanced_networks[MAX_INSTANCED_AREA_COUNT];
+static struct Network networks[MAX_BASE_AREA_COUNT];
+
+
+/* The only thing that differs between instances is where their
+   portals lead. Each instance refers to its base area's network, and
+   keeps a small table of links on the side */
+static struct Link links[MAX_INSTANCED_AREA_COUNT][MAX_PORTAL_COUNT];
 
 
 void LoadNetwork(Area id, const char* filepath) {
@@ -300,7 +585,7 @@ void LoadNetwork(Area id, const char* filepath) {
 	return;
     }
     
-    struct Network* network = &base_networks[id.base];
+    struct Network* network = &networks[id.base];
 
     char* line = source;
     while (line) {
@@ -324,8 +609,6 @@ void LoadNetwork(Area id, const char* filepath) {
 	    if (s == 9) {
 		struct Portal* p = &network->portals[network->portal_count++];
 		p->width = width;
-		p->portal_index = 0;
-		p->destination = (Area) { .id=0 };
 		p->transform_out = Transformation(position,
 						  MulQ(rotation, AxisAngle(Vector3(0, 0, 1), PI)),
 						  Vector3(1, 1, 1));
@@ -340,469 +623,2083 @@ void LoadNetwork(Area id, const char* filepath) {
     }
 
     free(source);
+
+    /* Baked in area space, so every portal's outline is one draw */
+    const union Vector4 outline[5] = {
+	{ .x=-1, .y=-1, .w=1 },
+	{ .x=1, .y=-1, .w=1 },
+	{ .x=1, .y=0, .w=1 },
+	{ .x=0, .y=1, .w=1 },
+	{ .x=-1, .y=0, .w=1 },
+    };
+    imColor3ub(0, 100, 50);
+    rtBegin(); {
+	for (int i=0; i<network->portal_count; ++i) {
+	    union Matrix4 transform = network->portals[i].transform_in;
+	    union Vector3 segments[10];
+	    for (int j=0; j<5; ++j) {
+		segments[2*j] = Transform4(transform, outline[j]).xyz;
+		segments[(2*j + 9) % 10] = segments[2*j];
+	    }
+	    imVertices3(10, segments);
+	}
+    } network->outline_mesh = rtEnd();
 }
 
 
 void InstanceNetwork(Area id) {
-    instanced_networks[id.instance] = base_networks[id.base];
+    /* A fresh instance leads nowhere until the world grows into it */
+    for (int portal_index=0; portal_index<MAX_PORTAL_COUNT; portal_index++) {
+	links[id.instance][portal_index].destination = INVALID_AREA;
+	links[id.instance][portal_index].portal_index = 0;
+    }
 }
 
 
-void LinkInstancedNetworks(void) {
-    /* boi */
-    /* Iterate through all instanced areas, marking all portals as
-       unconnected */
-    for (int instance_index=0; instance_index<instance_count; instance_index++) {
-	struct Network* network = &instanced_networks[instance_index];
-	for (int portal_index=0; portal_index<network->portal_count; portal_index++) {
-	    network->portals[portal_index].destination = INVALID_AREA;
-	}
-    }
-    
-    /* Iterate through all instanced areas, connecting one random
-       portal of each to another */
-    for (int instance_index=0; instance_index<instance_count; instance_index++) {
-	int instance_index_a = instance_index;
-	int instance_index_b = (instance_index + 1) % instance_count;
-	
-	struct Network* network_a = &instanced_networks[instance_index_a];
-	struct Network* network_b = &instanced_networks[instance_index_b];
-
-	/* In theory, only one portal should be linked, so if we
-	   happened to get the portal, just increment the portal
-	   index */
-	/* NOTE If an area only has a single portal, this won't work
-	   properly */
-	int portal_index_a = rand() % network_a->portal_count;
-	if (!is_invalid(network_a->portals[portal_index_a].destination)) {
-	    portal_index_a = (portal_index_a + 1) % network_a->portal_count;
-	}
-	int portal_index_b = rand() % network_b->portal_count;
-	if (!is_invalid(network_b->portals[portal_index_b].destination)) {
-	    portal_index_b = (portal_index_b + 1) % network_b->portal_count;
-	}
-
-	network_a->portals[portal_index_a].destination = instances[instance_index_b];
-	network_a->portals[portal_index_a].portal_index = portal_index_b;
-	
-	network_b->portals[portal_index_b].destination = instances[instance_index_a];
-	network_b->portals[portal_index_b].portal_index = portal_index_a;
-    }
-
-    /* Create a list of all unlinked portals, randomize that list,
-       then link the portals together */
-    int unlinked_portal_count = 0;
-    struct Unlinked {
-	int instance_index;
-	int portal_index;
-    } unlinked_portals[MAX_INSTANCED_AREA_COUNT * MAX_PORTAL_COUNT];
-    for (int instance_index=0; instance_index<instance_count; instance_index++) {
-	struct Network* network = &instanced_networks[instance_index];
-	for (int portal_index=0; portal_index<network->portal_count; portal_index++) {
-	    if (is_invalid(network->portals[portal_index].destination)) {
-		unlinked_portals[unlinked_portal_count].instance_index = instance_index;
-		unlinked_portals[unlinked_portal_count].portal_index = portal_index;
-		unlinked_portal_count++;
-	    }
-	}
-    }
-    
-    /* Adapted from https://stackoverflow.com/a/6127606 */
-    if (unlinked_portal_count > 1) {
-	size_t i;
-	for (i=0; i<unlinked_portal_count-1; i++) {
-	    size_t j = i + rand() / (RAND_MAX / (unlinked_portal_count - i) + 1);
-	    struct Unlinked t = unlinked_portals[j];
-	    unlinked_portals[j] = unlinked_portals[i];
-	    unlinked_portals[i] = t;
-	}
-    }
+static struct Network* get_network(Area id) {
+    return &networks[id.base];
+}
 
-    int even_unlinked_portal_count = unlinked_portal_count - (unlinked_portal_count % 2);
-    for (int index=0; index<even_unlinked_portal_count; index += 2) {
-	struct Unlinked a = unlinked_portals[index];
-	struct Unlinked b = unlinked_portals[index + 1];
 
-	struct Network* network_a = &instanced_networks[a.instance_index];
-	struct Network* network_b = &instanced_networks[b.instance_index];
+static const struct Link UNLINKED = { .destination={ .base=MAX_BASE_AREA_COUNT, .instance=MAX_INSTANCED_AREA_COUNT } };
 
-	network_a->portals[a.portal_index].destination = instances[b.instance_index];
-	network_a->portals[a.portal_index].portal_index = b.portal_index;
-	
-	network_b->portals[b.portal_index].destination = instances[a.instance_index];
-	network_b->portals[b.portal_index].portal_index = a.portal_index;
-    }
 
-    /* If there is a single portal left over, just link it to itself */
-    /* TODO Modify this so that we end up with three portals linking to each other */
-    if (unlinked_portal_count % 2) {
-	struct Unlinked a = unlinked_portals[unlinked_portal_count - 1];
+static const struct Link* get_link(Area id, int portal_index) {
+    if (id.instance >= MAX_INSTANCED_AREA_COUNT) {
+	/* Base areas aren't linked to anything */
+	return &UNLINKED;
+    } else {
+	return &links[id.instance][portal_index];
+    }
+}
 
-	struct Network* network_a = &instanced_networks[a.instance_index];
 
-	network_a->portals[a.portal_index].destination = instances[a.instance_index];
-	network_a->portals[a.portal_index].portal_index = a.portal_index;
-    }
+void CopyLinkTable(struct LinkTable* table) {
+    memcpy(table->links, links, sizeof(links));
 }
 
 
-static struct Network* get_network(Area id) {
-    if (id.instance == MAX_INSTANCED_AREA_COUNT) {
-	return &base_networks[id.base];
-    } else {
-	return &instanced_networks[id.instance];
-    }
+/* Drawing can happen while the world grows on another thread, so it
+   walks through a copy of the links when it's been given one */
+static const struct LinkTable* drawn_links = NULL;
+
+
+void DrawWithLinkTable(const struct LinkTable* table) {
+    drawn_links = table;
 }
 
 
-void DrawNetwork(Area id) {
-    struct Network* network = get_network(id);
-    imColor3ub(0, 100, 50);
-    for (int i=0; i<network->portal_count; ++i) {
-	struct Portal* out_portal = &network->portals[i];
-	imModel(out_portal->transform_in);
-	imBegin(GL_LINE_LOOP); {
-	    imVertex2f(-1, -1);
-	    imVertex2f(1, -1);
-	    imVertex2f(1, 0);
-	    imVertex2f(0, 1);
-	    imVertex2f(-1, 0);
-	} imEnd();
+static const struct Link* get_drawn_link(Area id, int portal_index) {
+    if (drawn_links && id.instance < MAX_INSTANCED_AREA_COUNT) {
+	return &drawn_links->links[id.instance][portal_index];
+    } else {
+	return get_link(id, portal_index);
     }
 }
 
 
-#define MAX_STATIC_COUNT 128
-struct Scenery {
-    int static_count;
-    struct {
-	union Matrix4 transform;
-	GLuint64 mesh;
-    } statics[MAX_STATIC_COUNT];
-};
+/* Bumped whenever any link changes, so anything derived from the
+   shape of the world, like cached paths, knows to start over */
+static u32 world_version = 0;
 
 
-static struct Scenery sceneries[MAX_BASE_AREA_COUNT];
+u32 GetWorldVersion(void) {
+    return world_version;
+}
 
 
-void LoadScenery(Area id, const char* filepath) {
-    char* source = fopenstr(filepath);
-    if (!source) {
-	Warn("Unable to open `%s`. Does it exist?\n", filepath);
-	return;
-    }
+static void link_portals(Area a, int portal_index_a, Area b, int portal_index_b) {
+    world_version++;
 
-    struct Scenery* scenery = &sceneries[id.base];
+    links[a.instance][portal_index_a].destination = b;
+    links[a.instance][portal_index_a].portal_index = portal_index_b;
 
-    char* line = source;
-    while (line) {
-	char * endline = strchr(line, '\n');
-	if (endline) {
-	    *endline = '\0';
-	    
-	    char mesh_name[32];
+    links[b.instance][portal_index_b].destination = a;
+    links[b.instance][portal_index_b].portal_index = portal_index_a;
+}
 
-	    union Vector3 translation;
-	    union Quaternion rotation;
-	    union Vector3 scale;
-	    
-	    int s = sscanf(line,
-			   "%s "
-			   "%f,%f,%f "
-			   "%f,%f,%f,%f "
-			   "%f,%f,%f",
-			   mesh_name,
-			   &translation.x, &translation.y, &translation.z,
-			   &rotation.x, &rotation.y, &rotation.z, &rotation.w,
-			   &scale.x, &scale.y, &scale.z);
-	    
-	    if (s == 11) {
-		scenery->statics[scenery->static_count].transform = Transformation(translation, rotation, scale);
-		scenery->statics[scenery->static_count].mesh = rtLoadMeshAsset(mesh_name);
-		scenery->static_count++;
-	    }
 
-	    line = endline + 1;
-	} else {
-	    line = NULL;
+static void retire_instance(u16 instance_index) {
+    world_version++;
+
+    /* Mark every portal leading into this instance as unresolved, so
+       that the world grows a fresh instance there if the player ever
+       comes back this way */
+    for (int portal_index=0; portal_index<MAX_PORTAL_COUNT; portal_index++) {
+	struct Link* link = &links[instance_index][portal_index];
+	if (!is_invalid(link->destination)) {
+	    links[link->destination.instance][link->portal_index].destination = INVALID_AREA;
 	}
+	link->destination = INVALID_AREA;
     }
-    
-    free(source);
+
+    instance_is_live[instance_index] = FALSE;
+    instance_count--;
 }
 
 
-void DrawScenery(Area id) {
-    imUseProgram(lit_program);
-    struct LightGrid* light_grid = &light_grids[id.base];
-    imSetLights(light_grid);
-    struct Scenery* scenery = &sceneries[id.base];
-    for (int i=0; i<scenery->static_count; ++i) {
-	imModel(scenery->statics[i].transform);
-	rtDrawArrays(GL_TRIANGLES, scenery->statics[i].mesh);
+/* Number of portal hops from the area being grown around to each
+   instance, or -1 if the instance can't be reached */
+static int instance_distances[MAX_INSTANCED_AREA_COUNT];
+
+
+static void measure_distances(Area around) {
+    for (int instance_index=0; instance_index<MAX_INSTANCED_AREA_COUNT; instance_index++) {
+	instance_distances[instance_index] = -1;
     }
-}
 
+    u16 queue[MAX_INSTANCED_AREA_COUNT];
+    int head = 0, tail = 0;
+    instance_distances[around.instance] = 0;
+    queue[tail++] = around.instance;
 
-static void draw_children(Area id, int portal_index, union Matrix4 view, int depth) {
-    if (depth) {
-	struct Network* network = get_network(id);
-	for (int i=0; i<network->portal_count; i++) {
-	    if (i == portal_index) {
+    while (head < tail) {
+	u16 instance_index = queue[head++];
+	struct Network* network = get_network(instances[instance_index]);
+	for (int portal_index=0; portal_index<network->portal_count; portal_index++) {
+	    Area destination = links[instance_index][portal_index].destination;
+	    if (is_invalid(destination) || instance_distances[destination.instance] != -1) {
 		continue;
 	    }
-	    
-	    struct Portal* out_portal = &network->portals[i];
-	    struct Network* destination = get_network(out_portal->destination);
-	    struct Portal* in_portal = &destination->portals[out_portal->portal_index];
+	    instance_distances[destination.instance] = instance_distances[instance_index] + 1;
+	    queue[tail++] = destination.instance;
+	}
+    }
+}
+
 
-	    union Matrix4 destination_view = MulM4(out_portal->transform_out,
-						   InvertM4(in_portal->transform_in));
-	    destination_view = MulM4(view, destination_view);
+/* Chance, out of 4, that an unresolved portal closes a loop with
+   another unresolved portal nearby instead of leading somewhere new */
+#define LOOP_CHANCE 1
 
-	    draw_children(out_portal->destination,
-			  out_portal->portal_index,
-			  destination_view,
-			  depth - 1);
 
-	    imClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+/* Closing loops by choice must leave at least this many unresolved
+   portals behind, otherwise the world could seal itself off and stop
+   growing */
+#define MIN_UNRESOLVED_PORTAL_COUNT 2
 
-	    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-	    glDepthMask(GL_FALSE);
-	    glStencilFunc(GL_ALWAYS, 1, 0xFF);
-	    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
 
-	    imView(destination_view);
-	    imModel(in_portal->transform_in);
-	    imUseProgram(stencil_program);
-	    rtDrawArrays(GL_TRIANGLE_STRIP, portal_mesh);
-	    rtFlush();
+static int find_unresolved_portal(u16 excluded_instance, int excluded_portal,
+				  int max_distance, int min_candidate_count,
+				  Area* area, int* portal_index) {
+    int candidate_count = 0;
+    struct Unresolved {
+	u16 instance_index;
+	u8 portal_index;
+    } candidates[MAX_INSTANCED_AREA_COUNT * MAX_PORTAL_COUNT];
 
-	    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-	    glDepthMask(GL_TRUE);
-	    glStencilFunc(GL_EQUAL, 1, 0xFF);
-	    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    for (u16 instance_index=0; instance_index<MAX_INSTANCED_AREA_COUNT; instance_index++) {
+	int distance = instance_distances[instance_index];
+	if (!instance_is_live[instance_index] || distance == -1 || distance > max_distance) {
+	    continue;
+	}
 
-	    imUseProgram(lit_program);
-	    DrawScenery(out_portal->destination);
-	    rtFlush();
+	struct Network* network = get_network(instances[instance_index]);
+	for (int i=0; i<network->portal_count; i++) {
+	    if (instance_index == excluded_instance && i == excluded_portal) {
+		continue;
+	    }
+	    if (is_invalid(links[instance_index][i].destination)) {
+		candidates[candidate_count].instance_index = instance_index;
+		candidates[candidate_count].portal_index = i;
+		candidate_count++;
+	    }
 	}
     }
-}
 
+    if (candidate_count == 0 || candidate_count < min_candidate_count) {
+	return 0;
+    }
 
-void DrawSceneryRecursively(Area id, int portal_index, union Matrix4 view, int depth) {
-    rtBindVertexArray(SCENERY_VERTEX_ARRAY);
+    struct Unresolved pick = candidates[RandomBelow(GetStream(RANDOM_WORLD), candidate_count)];
+    *area = instances[pick.instance_index];
+    *portal_index = pick.portal_index;
+    return 1;
+}
 
-    glEnable(GL_STENCIL_TEST);
-    draw_children(id, portal_index, view, depth);
-    glDisable(GL_STENCIL_TEST);
 
-    /* glStencilFunc(GL_NOTEQUAL, 1, 0xFF); */
-    imView(view);
-    imClear(GL_DEPTH_BUFFER_BIT);
-    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-    struct Network* network = get_network(id);
-    for (int i=0; i<network->portal_count; i++) {
-	imModel(network->portals[i].transform_out);
-	rtDrawArrays(GL_TRIANGLE_STRIP, portal_mesh);
-    }
-    rtFlush();
-    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-    DrawScenery(id);
-    rtFlush();
-}
+static void resolve_portal(Area id, int portal_index, int max_distance) {
+    Area destination = INVALID_AREA;
+    int destination_portal_index = 0;
 
+    struct Random* random = GetStream(RANDOM_WORLD);
+    if (RandomBelow(random, 4) < LOOP_CHANCE) {
+	find_unresolved_portal(id.instance, portal_index,
+			       max_distance, MIN_UNRESOLVED_PORTAL_COUNT + 1,
+			       &destination, &destination_portal_index);
+    }
 
-#define COLLISION_FORCE 64.0f
-#define FRICTION_FORCE 8.0f
-#define GOAL_FORCE 32.0f
-#define MAX_COLLISION_ITERATION_COUNT 16
+    /* Otherwise grow a new instance of a random base area */
+    if (is_invalid(destination)) {
+	destination = instance_area(RandomBelow(random, area_count));
+	if (!is_invalid(destination)) {
+	    struct Network* network = get_network(destination);
+	    if (network->portal_count) {
+		destination_portal_index = RandomBelow(random, network->portal_count);
+		instance_distances[destination.instance] = instance_distances[id.instance] + 1;
+	    } else {
+		retire_instance(destination.instance);
+		destination = INVALID_AREA;
+	    }
+	}
+    }
 
+    /* If we've run out of room to instance anything else, we have no
+       choice but to close a loop */
+    /* Nothing is left to link to, so the portal stays shut, like any
+       other the world hasn't grown into yet, until slots free up */
+    if (is_invalid(destination)
+	&& !find_unresolved_portal(id.instance, portal_index, max_distance, 1,
+				   &destination, &destination_portal_index)) {
+	return;
+    }
 
-struct Agent {
-    Area area_id;
-    int cell_index;
-    float mass;
-    union Vector2 acceleration;
-    union Vector2 velocity;
-    union Vector2 position;
+    link_portals(id, portal_index, destination, destination_portal_index);
+}
 
-    /* TODO This should only be a Quaternion, but I don't want to fuck
-       around with converting between Matrix4 and Quaternion, so we'll
-       just use a Matrix4 instead */
-    union Matrix4 rotation;
-};
 
+static int evict_agents(u16 instance_index, Area refuge);
 
-#define MAX_AGENT_COUNT 8
-static Agent agent_count = 0;
-static struct Agent agents[MAX_AGENT_COUNT];
 
+/* Grow the world outward from `around`. Every portal of every
+   instance fewer than `depth` hops away is resolved, either to a new
+   instance or by closing a loop with another unresolved portal. If
+   every slot is taken and there's no loop left to close, the portal
+   stays shut until a later call frees a slot up.
 
-Agent SpawnAgent(Area area_id) {
-    Agent agent_id = agent_count++;
-    /* TODO Perform bounds checks */
-    struct Agent* agent = &agents[agent_id];
+   Instances more than `depth + 1` hops away, or cut off altogether,
+   are retired and their slots reused, so the world is effectively
+   infinite while memory stays flat. Anyone still in one is moved to
+   the farthest instance that's kept first, so new instances are only
+   ever linked to reachable ones and the world never contains isolated
+   islands. */
+void GrowWorld(Area around, int depth) {
+    if (around.instance >= MAX_INSTANCED_AREA_COUNT || !instance_is_live[around.instance]) {
+	return;
+    }
 
-    agent->area_id = area_id;
+    measure_distances(around);
 
-    struct Navmesh* navmesh = &navmeshes[area_id.base];
-    agent->cell_index = rand() % navmesh->cell_count;
+    Area refuge = around;
+    for (u16 instance_index=0; instance_index<MAX_INSTANCED_AREA_COUNT; instance_index++) {
+	int distance = instance_distances[instance_index];
+	if (instance_is_live[instance_index] && distance != -1 && distance <= depth + 1
+	    && distance > instance_distances[refuge.instance]) {
+	    refuge = instances[instance_index];
+	}
+    }
 
-    agent->mass = 1.0;
-    agent->acceleration = Vector2(0, 0);
-    agent->velocity = Vector2(0, 0);
+    for (u16 instance_index=0; instance_index<MAX_INSTANCED_AREA_COUNT; instance_index++) {
+	int distance = instance_distances[instance_index];
+	if (instance_is_live[instance_index] && (distance == -1 || distance > depth + 1)) {
+	    if (!instance_occupants[instance_index] || evict_agents(instance_index, refuge)) {
+		retire_instance(instance_index);
+	    }
+	}
+    }
 
-    union Triangle3 triangle = navmesh->cells[agent->cell_index].triangle;
-    agent->position = Vector2((triangle.a.x + triangle.b.x + triangle.c.x) / 3.0,
-			      (triangle.a.y + triangle.b.y + triangle.c.y) / 3.0);
+    for (int hop=0; hop<depth; hop++) {
+	for (u16 instance_index=0; instance_index<MAX_INSTANCED_AREA_COUNT; instance_index++) {
+	    if (!instance_is_live[instance_index] || instance_distances[instance_index] != hop) {
+		continue;
+	    }
 
-    agent->rotation = Rotation(AxisAngle(Vector3(0, 0, 1), to_radians((float)rand()/1000.0)));
-    
-    return agent_id;
+	    struct Network* network = get_network(instances[instance_index]);
+	    for (int portal_index=0; portal_index<network->portal_count; portal_index++) {
+		if (is_invalid(links[instance_index][portal_index].destination)) {
+		    resolve_portal(instances[instance_index], portal_index, depth);
+		}
+	    }
+	}
+    }
 }
 
 
-void MoveAgent(Agent agent_id, union Vector2 goal, float delta_time) {
-    /* Start each frame with 0 force */
-    union Vector2 force = Vector2(0, 0);
+void DrawNetwork(Area id) {
+    rtBindVertexArray(SCENERY_VERTEX_ARRAY);
+    imModel(Matrix4(1));
+    rtDrawArrays(GL_LINES, get_network(id)->outline_mesh);
+}
+
+
+/* Visibility is baked from lines of sight across the navmesh, which
+   end where they cross an edge that isn't shared with another cell.
+   That treats the navmesh's boundary as walls, and ignores height, so
+   areas are expected to be walled in at least up to eye height
+   wherever their navmesh ends; a railing low enough to see over
+   should have navmesh on both sides of it.
+
+   Lines are only sampled, so a portal seen between samples could be
+   missed. Each cell also sees whatever its neighbours do, and looking
+   in through a portal sees whatever the cell the portal's in does,
+   which narrows that down without ruling it out.
+
+   Neither can be promised by the navmesh alone, so culling by it is
+   only done when asked for, and otherwise every portal is drawn. */
+#define VISIBILITY_CELL_SAMPLES 4
+#define VISIBILITY_PORTAL_SAMPLES 5
+
+
+static int cull_portals = 0;
+void CullPortals(int enabled) {
+    cull_portals = enabled;
+}
+
+
+/* Whether a line from `from`, which is inside `cell_index`, reaches
+   `portal_index`'s edge without leaving the navmesh */
+static int sees_portal(struct Navmesh* navmesh, int cell_index, union Vector2 from, union Vector2 to, int portal_index) {
+    struct Edges* edges = &navmesh->edges;
+    union Vector2 direction = Sub2(to, from);
+    int entered_through = -1;
+
+    for (int step=0; step<=navmesh->cell_count; step++) {
+	float exit = INFINITY;
+	int exit_edge = -1;
+	for (int e=cell_index * 3; e<cell_index * 3 + 3; e++) {
+	    if (e == entered_through) {
+		continue;
+	    }
+	    union Vector2 normal = Vector2(edges->normals_x[e], edges->normals_y[e]);
+	    float approach = Dot2(normal, direction);
+	    if (approach >= 0) {
+		continue;
+	    }
+	    float s = (edges->offsets[e] - Dot2(normal, from)) / approach;
+	    if (s < exit) {
+		exit = s;
+		exit_edge = e;
+	    }
+	}
+
+	if (exit_edge < 0) {
+	    return 0;
+	}
+	switch (edges->connected_to[exit_edge]) {
+	case CELL: {
+	    if (exit >= 1) {
+		return 0;
+	    }
+	    /* Step across, and don't leave again through the same edge */
+	    int neighbor = edges->connection_index[exit_edge];
+	    struct Cell* next = &navmesh->cells[neighbor];
+	    entered_through = -1;
+	    for (int n=0; n<3; n++) {
+		if (next->connected_to[n] == CELL && next->connection_index[n] == cell_index) {
+		    entered_through = neighbor * 3 + n;
+		}
+	    }
+	    cell_index = neighbor;
+	    break;
+	}
+	case NETWORK:
+	    return edges->connection_index[exit_edge] == portal_index;
+	default:
+	    return 0;
+	}
+    }
+
+    return 0;
+}
+
+
+/* Points spread over a portal's edge, pulled in from the ends */
+static union Vector2 sample_portal(struct Navmesh* navmesh, struct Portal* portal, int portal_index, int sample) {
+    struct Cell* cell = &navmesh->cells[portal->cell_index];
+    for (int e=0; e<3; e++) {
+	if (cell->connected_to[e] == NETWORK && cell->connection_index[e] == portal_index) {
+	    union Vector2 a = cell->triangle.p[e].xy;
+	    union Vector2 b = cell->triangle.p[(e + 1) % 3].xy;
+	    float t = (sample + 0.5f) / VISIBILITY_PORTAL_SAMPLES;
+	    return Add2(a, Scale2(Sub2(b, a), t));
+	}
+    }
+    return cell->triangle.a.xy;
+}
+
+
+/* Points spread over a cell, kept a hair inside it */
+static union Vector2 sample_cell(struct Cell* cell, int u, int v) {
+    const float inset = 0.01f;
+    float fu = inset + (1 - 3 * inset) * u / VISIBILITY_CELL_SAMPLES;
+    float fv = inset + (1 - 3 * inset) * v / VISIBILITY_CELL_SAMPLES;
+    return FromBarycentric2(Vector3(fu, fv, 1 - fu - fv),
+			    cell->triangle.a.xy, cell->triangle.b.xy, cell->triangle.c.xy);
+}
+
+
+static int cell_sees_portal(struct Navmesh* navmesh, struct Network* network, int cell_index, int portal_index) {
+    struct Cell* cell = &navmesh->cells[cell_index];
+    struct Portal* portal = &network->portals[portal_index];
+    for (int u=0; u<=VISIBILITY_CELL_SAMPLES; u++) {
+	for (int v=0; u + v<=VISIBILITY_CELL_SAMPLES; v++) {
+	    union Vector2 from = sample_cell(cell, u, v);
+	    for (int p=0; p<VISIBILITY_PORTAL_SAMPLES; p++) {
+		union Vector2 to = sample_portal(navmesh, portal, portal_index, p);
+		if (sees_portal(navmesh, cell_index, from, to, portal_index)) {
+		    return 1;
+		}
+	    }
+	}
+    }
+    return 0;
+}
+
+
+/* Anything seen through a portal is seen along a line crossing its
+   edge, so looking in through a portal sees whatever its edge does */
+static int portal_sees_portal(struct Navmesh* navmesh, struct Network* network, int from_index, int to_index) {
+    struct Portal* from_portal = &network->portals[from_index];
+    struct Portal* to_portal = &network->portals[to_index];
+    union Vector2 centroid = Scale2(Add2(Add2(navmesh->cells[from_portal->cell_index].triangle.a.xy,
+					      navmesh->cells[from_portal->cell_index].triangle.b.xy),
+					 navmesh->cells[from_portal->cell_index].triangle.c.xy),
+				    1.0f / 3.0f);
+    for (int f=0; f<VISIBILITY_PORTAL_SAMPLES; f++) {
+	union Vector2 edge_point = sample_portal(navmesh, from_portal, from_index, f);
+	union Vector2 from = Add2(edge_point, Scale2(Sub2(centroid, edge_point), 0.01f));
+	for (int t=0; t<VISIBILITY_PORTAL_SAMPLES; t++) {
+	    union Vector2 to = sample_portal(navmesh, to_portal, to_index, t);
+	    if (sees_portal(navmesh, from_portal->cell_index, from, to, to_index)) {
+		return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+
+static void bake_visibility(Area id) {
+    struct Navmesh* navmesh = &navmeshes[id.base];
+    struct Network* network = &networks[id.base];
+
+    u8 sampled[MAX_CELL_COUNT];
+    for (int c=0; c<navmesh->cell_count; c++) {
+	sampled[c] = 0;
+	for (int p=0; p<network->portal_count; p++) {
+	    if (cell_sees_portal(navmesh, network, c, p)) {
+		sampled[c] |= 1 << p;
+	    }
+	}
+    }
+
+    for (int c=0; c<navmesh->cell_count; c++) {
+	struct Cell* cell = &navmesh->cells[c];
+	navmesh->visible_portals[c] = sampled[c];
+	for (int e=0; e<3; e++) {
+	    if (cell->connected_to[e] == CELL) {
+		navmesh->visible_portals[c] |= sampled[cell->connection_index[e]];
+	    }
+	}
+    }
+
+    for (int from=0; from<network->portal_count; from++) {
+	network->visible_through[from] = navmesh->visible_portals[network->portals[from].cell_index];
+	for (int to=0; to<network->portal_count; to++) {
+	    if (to != from && portal_sees_portal(navmesh, network, from, to)) {
+		network->visible_through[from] |= 1 << to;
+	    }
+	}
+	network->visible_through[from] &= (u8)~(1 << from);
+    }
+}
+
+
+/* Which of an area's portals might be seen, from a cell, or looking
+   in through one of its portals. Knowing neither, all of them. */
+static u8 get_visible_portals(Area id, int portal_index, int cell_index) {
+    if (!cull_portals) {
+	return (u8)((1 << MAX_PORTAL_COUNT) - 1);
+    }
+    if (cell_index >= 0) {
+	return navmeshes[id.base].visible_portals[cell_index];
+    }
+    if (portal_index >= 0) {
+	return networks[id.base].visible_through[portal_index];
+    }
+    return (u8)((1 << MAX_PORTAL_COUNT) - 1);
+}
+
+
+int GetCellCount(Area id) {
+    return navmeshes[id.base].cell_count;
+}
+
+
+union Triangle3 GetCellTriangle(Area id, int cell_index) {
+    return navmeshes[id.base].cells[cell_index].triangle;
+}
+
+
+int GetCellNeighbor(Area id, int cell_index, int edge_index, Area* neighbor_area, int* neighbor_index) {
+    struct Cell* cell = &navmeshes[id.base].cells[cell_index];
+    switch (cell->connected_to[edge_index]) {
+    case CELL:
+	*neighbor_area = id;
+	*neighbor_index = cell->connection_index[edge_index];
+	return 1;
+    case NETWORK: {
+	const struct Link* link = get_link(id, cell->connection_index[edge_index]);
+	if (is_invalid(link->destination)) {
+	    return 0;
+	}
+	*neighbor_area = link->destination;
+	*neighbor_index = get_network(link->destination)->portals[link->portal_index].cell_index;
+	return 1;
+    }
+    default:
+	return 0;
+    }
+}
+
+
+int GetCellPortal(Area id, int cell_index, int edge_index) {
+    struct Cell* cell = &navmeshes[id.base].cells[cell_index];
+    return (cell->connected_to[edge_index] == NETWORK) ? cell->connection_index[edge_index] : -1;
+}
+
+
+int GetPortalCount(Area id) {
+    return get_network(id)->portal_count;
+}
+
+
+union Vector2 GetPortalPosition(Area id, int portal_index) {
+    return get_network(id)->portals[portal_index].transform_in.vectors[3].xy;
+}
+
+
+int GetPortalLink(Area id, int portal_index, Area* destination, int* destination_portal_index) {
+    const struct Link* link = get_link(id, portal_index);
+    if (is_invalid(link->destination)) {
+	return 0;
+    }
+    *destination = link->destination;
+    *destination_portal_index = link->portal_index;
+    return 1;
+}
+
+
+#define MAX_STATIC_COUNT 128
+#define STATICS_PER_NODE 8
+#define MAX_SCENERY_NODE_COUNT (MAX_STATIC_COUNT / STATICS_PER_NODE)
+struct Scenery {
+    int static_count;
+    struct Static {
+	union Matrix4 transform;
+	const GLuint64* lods;
+	struct Bounds3 bounds;
+    } statics[MAX_STATIC_COUNT];
+
+    /* A two level hierarchy over the statics. Each node bounds a run
+       of neighboring statics, and the whole area is bounded above that */
+    struct Bounds3 bounds;
+    int node_count;
+    struct Bounds3 nodes[MAX_SCENERY_NODE_COUNT];
+
+    /* Every static baked in place into one mesh, if batching */
+    GLuint64 batch;
+};
+
+
+static struct Scenery sceneries[MAX_BASE_AREA_COUNT];
+
+
+static int batch_scenery = 0;
+void BatchScenery(int enabled) {
+    batch_scenery = enabled;
+}
+
+
+static float get_axis(union Vector3 v, int axis) {
+    return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+}
+
+
+/* Sorting the statics along the area's longest side keeps each run
+   of them close together, which is all the hierarchy needs */
+static void build_scenery_hierarchy(struct Scenery* scenery) {
+    scenery->bounds = EmptyBounds3();
+    for (int i=0; i<scenery->static_count; ++i) {
+	scenery->bounds = MergeBounds3(scenery->bounds, scenery->statics[i].bounds);
+    }
+
+    union Vector3 size = Sub3(scenery->bounds.max, scenery->bounds.min);
+    int axis = (size.x >= size.y && size.x >= size.z) ? 0 : (size.y >= size.z) ? 1 : 2;
+
+    for (int i=1; i<scenery->static_count; ++i) {
+	struct Static s = scenery->statics[i];
+	float key = get_axis(s.bounds.center, axis);
+	int j = i;
+	for (; j>0 && get_axis(scenery->statics[j - 1].bounds.center, axis) > key; --j) {
+	    scenery->statics[j] = scenery->statics[j - 1];
+	}
+	scenery->statics[j] = s;
+    }
+
+    scenery->node_count = (scenery->static_count + STATICS_PER_NODE - 1) / STATICS_PER_NODE;
+    for (int n=0; n<scenery->node_count; ++n) {
+	scenery->nodes[n] = EmptyBounds3();
+	for (int i=n*STATICS_PER_NODE; i<(n + 1)*STATICS_PER_NODE && i<scenery->static_count; ++i) {
+	    scenery->nodes[n] = MergeBounds3(scenery->nodes[n], scenery->statics[i].bounds);
+	}
+    }
+}
+
+
+void LoadScenery(Area id, const char* filepath) {
+    char* source = fopenstr(filepath);
+    if (!source) {
+	Warn("Unable to open `%s`. Does it exist?\n", filepath);
+	return;
+    }
+
+    struct Scenery* scenery = &sceneries[id.base];
+    char mesh_names[MAX_STATIC_COUNT][32];
+
+    char* line = source;
+    while (line) {
+	char * endline = strchr(line, '\n');
+	if (endline) {
+	    *endline = '\0';
+	    
+	    char mesh_name[32];
+
+	    union Vector3 translation;
+	    union Quaternion rotation;
+	    union Vector3 scale;
+	    
+	    int s = sscanf(line,
+			   "%s "
+			   "%f,%f,%f "
+			   "%f,%f,%f,%f "
+			   "%f,%f,%f",
+			   mesh_name,
+			   &translation.x, &translation.y, &translation.z,
+			   &rotation.x, &rotation.y, &rotation.z, &rotation.w,
+			   &scale.x, &scale.y, &scale.z);
+	    
+	    if (s == 11) {
+		struct Static* s = &scenery->statics[scenery->static_count];
+		struct Bounds3 mesh_bounds;
+		s->transform = Transformation(translation, rotation, scale);
+		rtLoadMeshAsset(mesh_name, &mesh_bounds);
+		s->lods = rtLoadMeshAssetLods(mesh_name);
+		s->bounds = TransformBounds3(s->transform, mesh_bounds);
+		strcpy(mesh_names[scenery->static_count], mesh_name);
+		scenery->static_count++;
+	    }
+
+	    line = endline + 1;
+	} else {
+	    line = NULL;
+	}
+    }
+    
+    free(source);
+
+    /* Scenery never moves, so it can be drawn with one draw call
+       at the cost of a copy of each mesh per static */
+    if (batch_scenery) {
+	int batched = 1;
+	rtBegin(); {
+	    for (int i=0; i<scenery->static_count; ++i) {
+		if (rtAppendMeshAsset(mesh_names[i], scenery->statics[i].transform) != SDL_OK) {
+		    batched = 0;
+		}
+	    }
+	} GLuint64 batch = rtEnd();
+
+	if (batched) {
+	    scenery->batch = batch;
+	} else {
+	    Warn("Unable to batch `%s`, so its statics will be drawn separately\n", filepath);
+	}
+    }
+
+    build_scenery_hierarchy(scenery);
+}
+
+
+/* Statics are drawn simpler the smaller they look from the eye, going
+   down a level each time they shrink past one of these fractions of
+   their distance, and a level more once they're seen through enough
+   portals. Batches only have the one level. */
+#define LOD_PORTAL_LEVEL 2
+static const float lod_sizes[MAX_MESH_LOD_COUNT - 1] = { 0.05f, 0.02f };
+
+
+static int get_lod(struct Bounds3 bounds, const union Vector3* eye, int level) {
+    if (!eye) {
+	return 0;
+    }
+
+    int lod = (level >= LOD_PORTAL_LEVEL) ? 1 : 0;
+    float distance = Magnitude3(Sub3(bounds.center, *eye));
+    for (int i=0; i<MAX_MESH_LOD_COUNT - 1; ++i) {
+	if (bounds.radius < lod_sizes[i] * distance) {
+	    lod++;
+	}
+    }
+    return (lod < MAX_MESH_LOD_COUNT) ? lod : MAX_MESH_LOD_COUNT - 1;
+}
+
+
+/* Only the statics that might be inside `frustum` are drawn, or all
+   of them if there's no frustum. `eye` is where they're seen from,
+   `level` how many portals they're seen through, and without an eye
+   they're drawn in full detail. */
+static void draw_scenery(Area id, const struct Frustum* frustum, const union Vector3* eye, int level) {
+    struct Scenery* scenery = &sceneries[id.base];
+    if (frustum && OutsideFrustum(frustum, scenery->bounds)) {
+	return;
+    }
+
+    imUseProgram(lit_program);
+    struct LightGrid* light_grid = &light_grids[id.base];
+    imSetLights(light_grid);
+    if ((GLsizei)scenery->batch) {
+	imModel(Matrix4(1));
+	rtDrawArrays(GL_TRIANGLES, scenery->batch);
+	return;
+    }
+    for (int n=0; n<scenery->node_count; ++n) {
+	if (frustum && OutsideFrustum(frustum, scenery->nodes[n])) {
+	    continue;
+	}
+	for (int i=n*STATICS_PER_NODE; i<(n + 1)*STATICS_PER_NODE && i<scenery->static_count; ++i) {
+	    struct Static* s = &scenery->statics[i];
+	    if (frustum && OutsideFrustum(frustum, s->bounds)) {
+		continue;
+	    }
+	    imModel(s->transform);
+	    rtDrawArrays(GL_TRIANGLES, s->lods[get_lod(s->bounds, eye, level)]);
+	}
+    }
+}
+
+
+void DrawScenery(Area id) {
+    draw_scenery(id, NULL, NULL, 0);
+}
+
+
+/* Set before drawing, and only read while drawing */
+static union Matrix4 drawn_projection;
+static int drawn_depth;
+
+
+/* Where a portal lands on screen, in normalized device coordinates,
+   clipped to what's already visible. If any corner is behind the
+   camera the portal could cover anything that's visible. */
+static union Rect get_portal_rect(struct Portal* portal, union Matrix4 view, union Rect visible) {
+    union Matrix4 clip = MulM4(drawn_projection, MulM4(view, get_portal_model(portal, portal->transform_out)));
+
+    float left = INFINITY, right = -INFINITY, bottom = INFINITY, top = -INFINITY;
+    for (int i=0; i<4; ++i) {
+	union Vector4 corner = Transform4(clip, Vector4(portal_quad[i].x, portal_quad[i].y, portal_quad[i].z, 1));
+	if (corner.w <= 0) {
+	    return visible;
+	}
+	left = fminf(left, corner.x / corner.w);
+	right = fmaxf(right, corner.x / corner.w);
+	bottom = fminf(bottom, corner.y / corner.w);
+	top = fmaxf(top, corner.y / corner.w);
+    }
+
+    left = fmaxf(left, visible.x);
+    right = fminf(right, visible.x + visible.width);
+    bottom = fmaxf(bottom, visible.y);
+    top = fminf(top, visible.y + visible.height);
+    return Rect(left, bottom, right - left, top - bottom);
+}
+
+
+/* Portals that cover too few pixels to be worth drawing through, or
+   that are wholly past the far plane, are cut off along with everything
+   behind them */
+static float cutoff_width = 0, cutoff_height = 0;
+static float cutoff_pixels = 0, cutoff_distance = INFINITY;
+
+
+void SetPortalCutoff(GLsizei width, GLsizei height, float pixels, float distance) {
+    cutoff_width = width;
+    cutoff_height = height;
+    cutoff_pixels = pixels;
+    cutoff_distance = distance;
+}
+
+
+static int is_cut_off(struct Portal* portal, union Matrix4 view, union Rect portal_rect) {
+    float pixels = (portal_rect.width * cutoff_width / 2) * (portal_rect.height * cutoff_height / 2);
+    if (pixels < cutoff_pixels) {
+	return 1;
+    }
+
+    /* The eye is the origin of view space, so the nearest point of
+       the portal is found by clamping the eye onto it */
+    union Matrix4 model = MulM4(view, get_portal_model(portal, portal->transform_out));
+    union Vector3 corners[3];
+    for (int i=0; i<3; ++i) {
+	corners[i] = Transform4(model, Vector4(portal_quad[i].x, portal_quad[i].y, portal_quad[i].z, 1)).xyz;
+    }
+    union Vector3 across = Sub3(corners[1], corners[0]);
+    union Vector3 up = Sub3(corners[2], corners[0]);
+    float s = clampf(0, -Dot3(corners[0], across) / Dot3(across, across), 1);
+    float t = clampf(0, -Dot3(corners[0], up) / Dot3(up, up), 1);
+    union Vector3 nearest = Add3(corners[0], Add3(Scale3(across, s), Scale3(up, t)));
+    return Magnitude3(nearest) > cutoff_distance;
+}
+
+
+/* Clips away everything on the camera's side of a portal, which the
+   stencil would only have thrown away after shading it. If the camera
+   is all but touching the portal, the near plane is left alone, since
+   an oblique one would squash the depth range to nothing. */
+static union Matrix4 get_portal_projection(struct Portal* portal, union Matrix4 view) {
+    union Matrix4 transform = MulM4(view, portal->transform_in);
+    union Vector3 normal = transform.vectors[1].xyz;
+    union Vector3 point = transform.vectors[3].xyz;
+
+    union Vector4 plane = Vector4(normal.x, normal.y, normal.z, -Dot3(normal, point));
+    if (plane.w > 0) {
+	plane = Vector4(-plane.x, -plane.y, -plane.z, -plane.w);
+    }
+    if (plane.w > -0.01f) {
+	return drawn_projection;
+    }
+
+    return ObliqueNearPlane(drawn_projection, plane);
+}
+
+
+/* Whether a portal is hidden behind the scenery in front of it is
+   only known once that scenery has been drawn, which is after
+   everything seen through the portal. So each area's portals are
+   drawn again after its scenery, each in an occlusion query, and a
+   subtree is skipped if its portal came back hidden a few frames ago.
+
+   The same portal can be seen down many paths, so queries are kept
+   per path, hashed into the slots of whichever subtree it's in. Each
+   of those is recorded by one thread at a time, and so only ever
+   touched by one thread at a time. */
+#define QUERIES_PER_SUBTREE (MAX_QUERY_COUNT / MAX_PORTAL_COUNT)
+#define MAX_QUERY_PROBE_COUNT 8
+#define MAX_QUERY_LATENCY 4
+
+
+static struct {
+    u64 path;
+    GLuint first_frame;
+    GLuint last_frame;
+} occlusion_queries[MAX_QUERY_COUNT];
+static GLuint drawn_frame = 0;
+static THREAD_LOCAL int drawn_subtree;
+static SDL_atomic_t occluded_subtree_count;
+
+
+static u64 get_child_path(u64 path, int portal_index, Area destination) {
+    path = (path ^ (u64)(portal_index + 1)) * 1099511628211ull;
+    path = (path ^ destination.id) * 1099511628211ull;
+    return path;
+}
+
+
+/* The slot holding `path`, or if `acquire` is set one that can be
+   taken over for it. Returns -1 if there's neither. */
+static int find_query(int subtree, u64 path, int acquire) {
+    int free_index = -1;
+    for (int i=0; i<MAX_QUERY_PROBE_COUNT; ++i) {
+	int index = subtree*QUERIES_PER_SUBTREE + (int)((path + i) % QUERIES_PER_SUBTREE);
+	if (occlusion_queries[index].path == path) {
+	    return index;
+	}
+	GLuint last_frame = occlusion_queries[index].last_frame;
+	if (free_index < 0 && (!last_frame || last_frame + MAX_QUERY_LATENCY < drawn_frame)) {
+	    free_index = index;
+	}
+    }
+
+    if (acquire && free_index >= 0) {
+	occlusion_queries[free_index].path = path;
+	occlusion_queries[free_index].first_frame = drawn_frame;
+    }
+    return acquire ? free_index : -1;
+}
+
+
+/* Anything not known to be hidden is taken to be visible */
+static int is_occluded(int subtree, u64 path) {
+    int index = find_query(subtree, path, 0);
+    if (index < 0) {
+	return 0;
+    }
+
+    GLuint frame;
+    int result = imGetQueryResult(index, &frame);
+    return result == 0
+	&& frame >= occlusion_queries[index].first_frame
+	&& frame + MAX_QUERY_LATENCY >= drawn_frame;
+}
+
+
+/* Expects the depth buffer to hold the scenery the portals sit in,
+   and the stencil, if it's on, to hold where that scenery is seen */
+static void query_portal(int subtree, u64 path, struct Portal* portal) {
+    int index = find_query(subtree, path, 1);
+    if (index < 0) {
+	return;
+    }
+    occlusion_queries[index].last_frame = drawn_frame;
+
+    imModel(get_portal_model(portal, portal->transform_out));
+    imBeginQuery(index, drawn_frame);
+    rtDrawArrays(GL_TRIANGLE_STRIP, portal_mesh);
+    imEndQuery();
+}
+
+
+static void begin_portal_queries(void) {
+    imColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    imDepthMask(GL_FALSE);
+    imDepthFunc(GL_LEQUAL);
+    imUseProgram(stencil_program);
+}
+
+
+static void end_portal_queries(void) {
+    imDepthFunc(GL_LESS);
+    imDepthMask(GL_TRUE);
+    imColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+
+/* How many subtrees the last frame drawn skipped for being hidden */
+int GetOccludedSubtreeCount(void) {
+    return SDL_AtomicGet(&occluded_subtree_count);
+}
+
+
+/* Areas deep enough down the tree only cover a few pixels, so rather
+   than drawing them every frame they're drawn into small textures,
+   which are then drawn in their portals' place. An impostor is seen
+   through its portal as if through a window, so what it looks like
+   only depends on where the eye is, and it's kept until the eye has
+   moved too far from where it was drawn.
+
+   Like queries, impostors are kept per path and each subtree has its
+   own. They're only ever drawn by the thread recording the frame,
+   after the subtrees have been recorded, since that's the one that
+   knows where they go back to drawing afterwards. */
+#define IMPOSTORS_PER_SUBTREE 4
+#define IMPOSTOR_RESOLUTION 64
+#define IMPOSTOR_THRESHOLD 0.25f
+#define IMPOSTOR_NEAREST 0.05f
+#define IMPOSTOR_FARTHEST 100.0f
+
+
+static struct Impostor {
+    u64 path;
+    GLuint last_frame;
+    int drawn;
+    union Vector3 eye;
+    struct Framebuffer framebuffer;
+} impostors[MAX_PORTAL_COUNT][IMPOSTORS_PER_SUBTREE];
+
+
+static struct ImpostorDraw {
+    struct Impostor* impostor;
+    Area area;
+    int level;
+    union Matrix4 clip;
+} impostor_draws[MAX_PORTAL_COUNT][IMPOSTORS_PER_SUBTREE];
+static int impostor_draw_counts[MAX_PORTAL_COUNT];
+
+
+static int impostor_depth = 0;
+static GLuint impostor_target;
+static GLsizei impostor_target_width, impostor_target_height;
+
+
+/* Anything drawn at or below `depth` is drawn as an impostor, and
+   scenery goes back to being drawn into `framebuffer` afterwards.
+   The portals the eye looks straight through never are, however
+   shallow the recursion has been made to go. */
+void CreateImpostors(int depth, GLuint framebuffer, GLsizei width, GLsizei height) {
+    for (int i=0; i<MAX_PORTAL_COUNT; ++i) {
+	for (int j=0; j<IMPOSTORS_PER_SUBTREE; ++j) {
+	    impostors[i][j].framebuffer = CreateFramebuffer(IMPOSTOR_RESOLUTION, IMPOSTOR_RESOLUTION);
+	}
+    }
+
+    impostor_depth = depth;
+    impostor_target = framebuffer;
+    impostor_target_width = width;
+    impostor_target_height = height;
+}
+
+
+static struct Impostor* find_impostor(int subtree, u64 path) {
+    struct Impostor* oldest = NULL;
+    for (int i=0; i<IMPOSTORS_PER_SUBTREE; ++i) {
+	struct Impostor* impostor = &impostors[subtree][i];
+	if (impostor->path == path) {
+	    return impostor;
+	}
+	if (impostor->last_frame < drawn_frame && (!oldest || impostor->last_frame < oldest->last_frame)) {
+	    oldest = impostor;
+	}
+    }
+
+    if (oldest) {
+	oldest->path = path;
+	oldest->drawn = 0;
+    }
+    return oldest;
+}
+
+
+/* Draws the area seen through `in_portal` as an impostor, drawing the
+   impostor again first if need be. Returns 0 if it can't be, say if
+   the eye is nearly touching the portal or the impostors are all in
+   use. */
+static int draw_impostor(Area id, struct Portal* in_portal, u64 path, union Matrix4 view, int level) {
+    union Matrix4 model = get_portal_model(in_portal, in_portal->transform_in);
+    union Vector3 corners[3];
+    for (int i=0; i<3; ++i) {
+	corners[i] = Transform4(model, Vector4(portal_quad[i].x, portal_quad[i].y, portal_quad[i].z, 1)).xyz;
+    }
+
+    union Vector3 eye = InvertM4(view).vectors[3].xyz;
+    union Vector3 normal = Normalize3(Cross3(Sub3(corners[1], corners[0]), Sub3(corners[2], corners[0])));
+    if (Dot3(normal, Sub3(eye, corners[0])) < IMPOSTOR_NEAREST) {
+	return 0;
+    }
+
+    struct Impostor* impostor = find_impostor(drawn_subtree, path);
+    if (!impostor) {
+	return 0;
+    }
+
+    if (!impostor->drawn || Magnitude3(Sub3(eye, impostor->eye)) > IMPOSTOR_THRESHOLD) {
+	impostor_draws[drawn_subtree][impostor_draw_counts[drawn_subtree]++] = (struct ImpostorDraw){
+	    .impostor=impostor,
+	    .area=id,
+	    .level=level,
+	    .clip=WindowPerspective(eye, corners[0], corners[1], corners[2], IMPOSTOR_FARTHEST),
+	};
+	impostor->eye = eye;
+	impostor->drawn = 1;
+    }
+    impostor->last_frame = drawn_frame;
+
+    imClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+    imDrawStencil();
+    imProjection(drawn_projection);
+    imView(view);
+    imModel(model);
+    imUseProgram(stencil_program);
+    rtDrawArrays(GL_TRIANGLE_STRIP, portal_mesh);
+
+    imDrawColor();
+    imUseProgram(impostor_program);
+    imActiveTexture(GL_TEXTURE0 + IMPOSTOR_TEXTURE_UNIT);
+    imBindTexture(GL_TEXTURE_2D, impostor->framebuffer.color);
+    imActiveTexture(GL_TEXTURE0);
+    rtDrawArrays(GL_TRIANGLE_STRIP, impostor_mesh);
+    rtFlush();
+
+    return 1;
+}
+
+
+static void draw_impostors(int subtree) {
+    for (int i=0; i<impostor_draw_counts[subtree]; ++i) {
+	struct ImpostorDraw* draw = &impostor_draws[subtree][i];
+	struct Framebuffer* framebuffer = &draw->impostor->framebuffer;
+
+	imBindFramebuffer(framebuffer->buffer);
+	imViewport(0, 0, framebuffer->resolution.x, framebuffer->resolution.y);
+	imClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	imProjection(draw->clip);
+	imView(Matrix4(1));
+	struct Frustum frustum = Frustum(draw->clip, Rect(-1, -1, 2, 2));
+	draw_scenery(draw->area, &frustum, &draw->impostor->eye, draw->level);
+    }
+
+    if (impostor_draw_counts[subtree]) {
+	imBindFramebuffer(impostor_target);
+	imViewport(0, 0, impostor_target_width, impostor_target_height);
+	rtFlush();
+    }
+    impostor_draw_counts[subtree] = 0;
+}
+
+
+static void draw_children(Area id, int portal_index, u64 path, union Matrix4 view, union Rect visible, int depth);
+
+
+/* Draws everything seen through one of an area's portals, which is
+   then stenciled into place by drawing the portal itself. Nothing
+   is drawn for a portal that's out of sight. `path` is the path to
+   the area the portal is in. */
+static void draw_child(Area id, int portal_index, u64 path, union Matrix4 view, union Rect visible, int depth) {
+    struct Network* network = get_network(id);
+    const struct Link* link = get_drawn_link(id, portal_index);
+    if (is_invalid(link->destination)) {
+	return;
+    }
+
+    struct Portal* out_portal = &network->portals[portal_index];
+    union Rect portal_rect = get_portal_rect(out_portal, view, visible);
+    if (portal_rect.width <= 0 || portal_rect.height <= 0) {
+	return;
+    }
+    if (is_cut_off(out_portal, view, portal_rect)) {
+	return;
+    }
+
+    u64 child_path = get_child_path(path, portal_index, link->destination);
+    if (is_occluded(drawn_subtree, child_path)) {
+	SDL_AtomicAdd(&occluded_subtree_count, 1);
+	return;
+    }
+
+    struct Network* destination = get_network(link->destination);
+    struct Portal* in_portal = &destination->portals[link->portal_index];
+
+    union Matrix4 destination_view = MulM4(out_portal->transform_out,
+					   InvertM4(in_portal->transform_in));
+    destination_view = MulM4(view, destination_view);
+
+    int level = drawn_depth - depth + 1;
+    if (depth <= impostor_depth && level > 1 && draw_impostor(link->destination, in_portal, child_path, destination_view, level)) {
+	return;
+    }
+
+    draw_children(link->destination,
+		  link->portal_index,
+		  child_path,
+		  destination_view,
+		  portal_rect,
+		  depth - 1);
+
+    imClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+    imDrawStencil();
+
+    /* The stencil sits just off the portal, possibly on the clipped
+       side, so it's drawn with the ordinary projection */
+    imProjection(drawn_projection);
+    imView(destination_view);
+    imModel(get_portal_model(in_portal, in_portal->transform_in));
+    imUseProgram(stencil_program);
+    rtDrawArrays(GL_TRIANGLE_STRIP, portal_mesh);
+    rtFlush();
+
+    imDrawColor();
+
+    union Matrix4 projection = get_portal_projection(in_portal, destination_view);
+    imProjection(projection);
+    imUseProgram(lit_program);
+    struct Frustum frustum = Frustum(MulM4(projection, destination_view), portal_rect);
+    union Vector3 eye = InvertM4(destination_view).vectors[3].xyz;
+    draw_scenery(link->destination, &frustum, &eye, level);
+
+    /* Only the portals whose subtrees would be drawn are worth asking
+       about */
+    if (depth > 1) {
+	u8 visible_portals = get_visible_portals(link->destination, link->portal_index, -1);
+	begin_portal_queries();
+	for (int i=0; i<destination->portal_count; i++) {
+	    const struct Link* child_link = get_drawn_link(link->destination, i);
+	    if (i != link->portal_index && (visible_portals & (1 << i)) && !is_invalid(child_link->destination)) {
+		query_portal(drawn_subtree,
+			     get_child_path(child_path, i, child_link->destination),
+			     &destination->portals[i]);
+	    }
+	}
+	end_portal_queries();
+    }
+    rtFlush();
+}
+
+
+static void draw_children(Area id, int portal_index, u64 path, union Matrix4 view, union Rect visible, int depth) {
+    if (depth) {
+	struct Network* network = get_network(id);
+	u8 visible_portals = get_visible_portals(id, portal_index, -1);
+	for (int i=0; i<network->portal_count; i++) {
+	    if (i != portal_index && (visible_portals & (1 << i))) {
+		draw_child(id, i, path, view, visible, depth);
+	    }
+	}
+    }
+}
+
+
+/* Each subtree seen through the nearest portals gets recorded on its
+   own thread into its own command list. The lists are then appended
+   in portal order, which is the order they'd have been recorded in
+   one after another, so the stencil and depth clears still line up. */
+struct Subtrees {
+    Area id;
+    int portal_index;
+    u8 visible_portals;
+    u64 path;
+    union Matrix4 view;
+    union Rect visible;
+    int depth;
+};
 
-    /* Move towards the goal */
-    force = Add2(force, Scale2(Normalize2(goal), GOAL_FORCE * GetMoveScalar()));
-
-    /* Factor in friction based on the agent's velocity */
-    struct Agent* agent = &agents[agent_id];
-    force = Add2(force, Scale2(Negate2(Normalize2(agent->velocity)),
-			       Magnitude2(agent->velocity) * FRICTION_FORCE));
-
-    /* Collision forces */
-    int iteration_count;
-    for (iteration_count=0; iteration_count<MAX_COLLISION_ITERATION_COUNT; iteration_count++) {
-	union Vector2 acceleration = Scale2(force, 1.0 / agent->mass);
-	union Vector2 velocity = Add2(agent->velocity, Scale2(acceleration, delta_time));
-	union Vector2 position = Add2(agent->position, Scale2(velocity, delta_time));
-
-	struct Navmesh* navmesh = &navmeshes[agent->area_id.base];
-	struct Cell* cell = &navmesh->cells[agent->cell_index];
-	
-	struct {
-	    float distance;
-	    int edge_index;
-	    union Vector2 a, b;
-	} hit = { .distance=INFINITY, .edge_index=-1 };
 
-	for (int edge_index=0; edge_index<3; edge_index++) {
-	    union Vector2 a, b;
-	    a = cell->triangle.p[edge_index].xy;
-	    b = cell->triangle.p[(edge_index + 1) % 3].xy;
-
-	    float s = Sign2(position, Line2(a, b));
-	    if (s <= 0) {
-		union Vector2 point = Intersect2(Line2(agent->position, position),
-						 Line2(a, b));
-
-		float distance = DistanceSquared2(agent->position, point);
-		if (distance <= hit.distance) {
-		    hit.distance = distance;
-		    hit.edge_index = edge_index;
-		    hit.a = a;
-		    hit.b = b;
+static void record_subtree(int job_index, int worker_index, void* data) {
+    struct Subtrees* subtrees = data;
+
+    imBeginCommandList(job_index);
+    drawn_subtree = job_index;
+    if (job_index != subtrees->portal_index && (subtrees->visible_portals & (1 << job_index))) {
+	draw_child(subtrees->id, job_index, subtrees->path, subtrees->view, subtrees->visible, subtrees->depth);
+    }
+    imEndCommandList();
+}
+
+
+static void draw_children_in_parallel(Area id, int portal_index, int cell_index, u64 path,
+				      union Matrix4 view, union Rect visible, int depth) {
+    if (depth) {
+	struct Subtrees subtrees = {
+	    .id=id, .portal_index=portal_index,
+	    .visible_portals=get_visible_portals(id, portal_index, cell_index),
+	    .path=path, .view=view, .visible=visible, .depth=depth,
+	};
+	int portal_count = get_network(id)->portal_count;
+	RunJobs(portal_count, record_subtree, &subtrees);
+
+	/* Impostors are drawn before anything that shows them */
+	imDisable(GL_STENCIL_TEST);
+	for (int i=0; i<portal_count; i++) {
+	    draw_impostors(i);
+	}
+	imEnable(GL_STENCIL_TEST);
+
+	for (int i=0; i<portal_count; i++) {
+	    imAppendCommandList(i);
+	}
+    }
+}
+
+
+void DrawSceneryRecursively(Area id, int portal_index, int cell_index,
+			    union Matrix4 projection, union Matrix4 view, int depth) {
+    drawn_projection = projection;
+    drawn_depth = depth;
+    drawn_frame++;
+    SDL_AtomicSet(&occluded_subtree_count, 0);
+    union Rect screen = Rect(-1, -1, 2, 2);
+    u64 path = get_child_path(0, -1, id);
+
+    rtBindVertexArray(SCENERY_VERTEX_ARRAY);
+
+    imEnable(GL_STENCIL_TEST);
+    draw_children_in_parallel(id, portal_index, cell_index, path, view, screen, depth);
+    imDisable(GL_STENCIL_TEST);
+
+    /* glStencilFunc(GL_NOTEQUAL, 1, 0xFF); */
+    imProjection(projection);
+    imView(view);
+    imClear(GL_DEPTH_BUFFER_BIT);
+    imColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    struct Network* network = get_network(id);
+    for (int i=0; i<network->portal_count; i++) {
+	imModel(get_portal_model(&network->portals[i], network->portals[i].transform_out));
+	rtDrawArrays(GL_TRIANGLE_STRIP, portal_mesh);
+    }
+    rtFlush();
+    imColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    struct Frustum frustum = Frustum(MulM4(projection, view), screen);
+    union Vector3 eye = InvertM4(view).vectors[3].xyz;
+    draw_scenery(id, &frustum, &eye, 0);
+
+    /* The portals are already in the depth buffer, hence the depth
+       test letting equal depths through */
+    if (depth) {
+	u8 visible_portals = get_visible_portals(id, portal_index, cell_index);
+	begin_portal_queries();
+	for (int i=0; i<network->portal_count; i++) {
+	    const struct Link* link = get_drawn_link(id, i);
+	    if (i != portal_index && (visible_portals & (1 << i)) && !is_invalid(link->destination)) {
+		query_portal(i, get_child_path(path, i, link->destination), &network->portals[i]);
+	    }
+	}
+	end_portal_queries();
+    }
+    rtFlush();
+}
+
+
+#define AGENT_RADIUS 0.25f
+#define SEPARATION_FORCE 48.0f
+#define FRICTION_FORCE 8.0f
+#define GOAL_FORCE 32.0f
+#define MAX_SWEEP_COUNT 8
+
+/* Agents on their way somewhere only keep the next few steps of the
+   path there, and find the path again each time they step into
+   another cell, which the path cache makes cheap */
+#define AGENT_LOOKAHEAD 2
+
+
+/* Agents are stored as a structure of arrays, so that the parts of
+   each tick that treat every agent the same way run as tight loops
+   over plain floats, which the compiler is free to vectorize. */
+#define MAX_AGENT_COUNT 16384
+
+
+static Agent agent_count = 0;
+static struct {
+    Area area_ids[MAX_AGENT_COUNT];
+    int cell_indices[MAX_AGENT_COUNT];
+    float inverse_masses[MAX_AGENT_COUNT];
+    float goals_x[MAX_AGENT_COUNT], goals_y[MAX_AGENT_COUNT];
+    float forces_x[MAX_AGENT_COUNT], forces_y[MAX_AGENT_COUNT];
+    float velocities_x[MAX_AGENT_COUNT], velocities_y[MAX_AGENT_COUNT];
+    float positions_x[MAX_AGENT_COUNT], positions_y[MAX_AGENT_COUNT];
+    /* Agents only ever turn about the z axis, so a single angle is
+       all we need instead of a whole rotation matrix */
+    float headings[MAX_AGENT_COUNT];
+
+    /* Where agents are headed, if anywhere, and how they get there.
+       Each agent has its own stream, so it can pick somewhere new to
+       wander off to from whichever worker steps it. */
+    Area destination_areas[MAX_AGENT_COUNT];
+    float destinations_x[MAX_AGENT_COUNT], destinations_y[MAX_AGENT_COUNT];
+    float speeds[MAX_AGENT_COUNT];
+    int wanders[MAX_AGENT_COUNT];
+    Area planned_areas[MAX_AGENT_COUNT];
+    int planned_cells[MAX_AGENT_COUNT];
+    struct Waypoint lookaheads[MAX_AGENT_COUNT][AGENT_LOOKAHEAD];
+    int lookahead_counts[MAX_AGENT_COUNT];
+    int lookahead_progress[MAX_AGENT_COUNT];
+    int lookahead_is_final[MAX_AGENT_COUNT];
+    struct Random randoms[MAX_AGENT_COUNT];
+} agents;
+
+
+static void occupy(Area area_id, int count) {
+    if (area_id.instance < MAX_INSTANCED_AREA_COUNT) {
+	instance_occupants[area_id.instance] += count;
+    }
+}
+
+
+static Agent spawn_agent(Area area_id, int cell_index, union Vector2 position) {
+    if (agent_count == MAX_AGENT_COUNT) {
+	Warn("Trying to spawn too many agents!\n");
+	return INVALID_AGENT;
+    }
+
+    Agent agent_id = agent_count++;
+
+    agents.area_ids[agent_id] = area_id;
+    occupy(area_id, 1);
+
+    agents.cell_indices[agent_id] = cell_index;
+    agents.inverse_masses[agent_id] = 1.0f;
+    agents.goals_x[agent_id] = 0;
+    agents.goals_y[agent_id] = 0;
+    agents.velocities_x[agent_id] = 0;
+    agents.velocities_y[agent_id] = 0;
+    agents.positions_x[agent_id] = position.x;
+    agents.positions_y[agent_id] = position.y;
+
+    struct Random* random = GetStream(RANDOM_AGENTS);
+    agents.headings[agent_id] = RandomFloat(random) * PI2;
+    agents.randoms[agent_id] = SplitRandom(random);
+
+    agents.destination_areas[agent_id] = INVALID_AREA;
+    agents.wanders[agent_id] = 0;
+    
+    return agent_id;
+}
+
+
+Agent SpawnAgent(Area area_id) {
+    struct Navmesh* navmesh = &navmeshes[area_id.base];
+    if (navmesh->cell_count == 0) {
+	Warn("Trying to spawn an agent in an area without a navmesh!\n");
+	return INVALID_AGENT;
+    }
+
+    union Vector2 position;
+    int cell_index = random_point(navmesh, GetStream(RANDOM_AGENTS), &position);
+    return spawn_agent(area_id, cell_index, position);
+}
+
+
+static void place_agent(Agent agent_id, Area area_id, int cell_index, union Vector2 position) {
+    occupy(agents.area_ids[agent_id], -1);
+    occupy(area_id, 1);
+    agents.area_ids[agent_id] = area_id;
+    agents.cell_indices[agent_id] = cell_index;
+    agents.positions_x[agent_id] = position.x;
+    agents.positions_y[agent_id] = position.y;
+    agents.velocities_x[agent_id] = 0;
+    agents.velocities_y[agent_id] = 0;
+    agents.planned_cells[agent_id] = -1;
+}
+
+
+
+/* Moves everyone in an instance that's about to be retired somewhere
+   in `refuge` instead. Returns 0 if there's nowhere there to stand. */
+static int evict_agents(u16 instance_index, Area refuge) {
+    struct Navmesh* navmesh = &navmeshes[refuge.base];
+    if (navmesh->cell_count == 0) {
+	return 0;
+    }
+
+    struct Random* random = GetStream(RANDOM_WORLD);
+    for (Agent agent_id=0; agent_id<agent_count; agent_id++) {
+	if (agents.area_ids[agent_id].instance != instance_index) {
+	    continue;
+	}
+
+	union Vector2 position;
+	int cell_index = random_point(navmesh, random, &position);
+	place_agent(agent_id, refuge, cell_index, position);
+    }
+    return 1;
+}
+
+
+int GetAgentCount(void) {
+    return agent_count;
+}
+
+
+static void set_goal(Agent agent_id, union Vector2 goal, float speed) {
+    union Vector2 force = Scale2(Normalize2(goal), GOAL_FORCE * speed);
+    agents.goals_x[agent_id] = force.x;
+    agents.goals_y[agent_id] = force.y;
+}
+
+
+/* Heads straight for `goal`, forgetting wherever the agent was on its
+   way to */
+void SetAgentGoal(Agent agent_id, union Vector2 goal, float speed) {
+    agents.destination_areas[agent_id] = INVALID_AREA;
+    agents.wanders[agent_id] = 0;
+    set_goal(agent_id, goal, speed);
+}
+
+
+static void set_destination(Agent agent_id, Area area_id, union Vector2 destination, float speed) {
+    agents.destination_areas[agent_id] = area_id;
+    agents.destinations_x[agent_id] = destination.x;
+    agents.destinations_y[agent_id] = destination.y;
+    agents.speeds[agent_id] = speed;
+    agents.planned_cells[agent_id] = -1;
+}
+
+
+/* Finds its own way to `destination` in `area`, through portals if
+   need be, and stops once it's there */
+void SetAgentDestination(Agent agent_id, Area area_id, union Vector2 destination, float speed) {
+    agents.wanders[agent_id] = 0;
+    set_destination(agent_id, area_id, destination, speed);
+}
+
+
+/* Heads for somewhere in the area it's in or one next door, then once
+   it's there, somewhere else, and so on */
+static void wander_off(Agent agent_id) {
+    struct Random* random = &agents.randoms[agent_id];
+    Area area_id = agents.area_ids[agent_id];
+
+    /* Staying put counts as one of the ways to go */
+    int portal_index = (int)RandomBelow(random, get_network(area_id)->portal_count + 1) - 1;
+    const struct Link* link = (portal_index == -1) ? NULL : get_link(area_id, portal_index);
+    if (link && !is_invalid(link->destination)) {
+	area_id = link->destination;
+    }
+
+    struct Navmesh* navmesh = &navmeshes[area_id.base];
+    if (navmesh->cell_count == 0) {
+	agents.destination_areas[agent_id] = INVALID_AREA;
+	return;
+    }
+
+    union Vector2 destination;
+    random_point(navmesh, random, &destination);
+    set_destination(agent_id, area_id, destination, agents.speeds[agent_id]);
+}
+
+
+void SetAgentWandering(Agent agent_id, float speed) {
+    agents.wanders[agent_id] = 1;
+    agents.speeds[agent_id] = speed;
+    wander_off(agent_id);
+}
+
+
+/* Once an agent's there, or can't get there, it stops, unless it's
+   wandering, in which case it heads off somewhere else */
+static void move_on(Agent agent_id) {
+    if (agents.wanders[agent_id]) {
+	wander_off(agent_id);
+    } else {
+	agents.destination_areas[agent_id] = INVALID_AREA;
+    }
+}
+
+
+/* Finds the way from the cell the agent's in now, and keeps the first
+   few steps of it */
+static int plan_agent(Agent agent_id) {
+    static THREAD_LOCAL struct Path path;
+
+    Area area_id = agents.area_ids[agent_id];
+    union Vector2 position = Vector2(agents.positions_x[agent_id], agents.positions_y[agent_id]);
+    union Vector2 destination = Vector2(agents.destinations_x[agent_id], agents.destinations_y[agent_id]);
+    agents.planned_areas[agent_id] = area_id;
+    agents.planned_cells[agent_id] = agents.cell_indices[agent_id];
+
+    if (!FindPath(area_id, position, agents.destination_areas[agent_id], destination, &path)) {
+	return 0;
+    }
+
+    int count = path.waypoint_count < AGENT_LOOKAHEAD ? path.waypoint_count : AGENT_LOOKAHEAD;
+    memcpy(agents.lookaheads[agent_id], path.waypoints, count * sizeof(struct Waypoint));
+    agents.lookahead_counts[agent_id] = count;
+    agents.lookahead_progress[agent_id] = 0;
+    agents.lookahead_is_final[agent_id] = (count == path.waypoint_count);
+    return 1;
+}
+
+
+static void steer_agent(Agent agent_id) {
+    if (is_invalid(agents.destination_areas[agent_id])) {
+	return;
+    }
+
+    Area area_id = agents.area_ids[agent_id];
+    union Vector2 position = Vector2(agents.positions_x[agent_id], agents.positions_y[agent_id]);
+    int* progress = &agents.lookahead_progress[agent_id];
+
+    /* Find the way again after stepping into another cell, or after
+       running out of steps short of the destination */
+    if (agents.planned_areas[agent_id].id != area_id.id
+	|| agents.planned_cells[agent_id] != agents.cell_indices[agent_id]
+	|| (*progress == agents.lookahead_counts[agent_id] && !agents.lookahead_is_final[agent_id])) {
+	if (!plan_agent(agent_id)) {
+	    move_on(agent_id);
+	    set_goal(agent_id, Vector2(0, 0), 0);
+	    return;
+	}
+    }
+
+    union Vector2 direction = SteerAlongPath(agents.lookaheads[agent_id], agents.lookahead_counts[agent_id],
+					     progress, area_id, position);
+    if (*progress == agents.lookahead_counts[agent_id] && agents.lookahead_is_final[agent_id]) {
+	move_on(agent_id);
+    }
+    set_goal(agent_id, direction, agents.speeds[agent_id]);
+}
+
+
+static int is_wall_edge(Area area_id, struct Edges* edges, int e) {
+    if (edges->connected_to[e] == NETWORK) {
+	/* Portals the world hasn't grown into yet are solid */
+	return is_invalid(get_link(area_id, edges->connection_index[e])->destination);
+    }
+    return edges->connected_to[e] == NOTHING;
+}
+
+
+/* When a circle moving from `position` along `motion` first touches
+   the point `corner`, if that's sooner than `hit_time` */
+static void reach_corner(union Vector2 position, union Vector2 motion, union Vector2 corner,
+			 float* hit_time, union Vector2* hit_normal) {
+    union Vector2 offset = Sub2(position, corner);
+    float a = Dot2(motion, motion);
+    float b = 2.0f * Dot2(offset, motion);
+    float c = Dot2(offset, offset) - AGENT_RADIUS * AGENT_RADIUS;
+    if (b >= 0 || a == 0) {
+	return;
+    }
+
+    float time = 0;
+    if (c > 0) {
+	float discriminant = b * b - 4.0f * a * c;
+	if (discriminant < 0) {
+	    return;
+	}
+	time = (-b - sqrtf(discriminant)) / (2.0f * a);
+    }
+    if (time < *hit_time) {
+	*hit_time = time;
+	*hit_normal = Normalize2(Add2(offset, Scale2(motion, time)));
+    }
+}
+
+
+/* Walls of the cells around the agent's own can be closer than the
+   agent's radius without ever bounding its cell, so every wall in the
+   cells the swept circle's bounds overlap is tested too, as a
+   segment with rounded ends. Returns whether any was reached sooner
+   than `hit_time`. */
+static int reach_nearby_walls(Area area_id, int cell_index, union Vector2 position, union Vector2 motion,
+			      float* hit_time, union Vector2* hit_normal) {
+    struct Navmesh* navmesh = &navmeshes[area_id.base];
+    struct Edges* edges = &navmesh->edges;
+    union Vector2 end = Add2(position, motion);
+    union Vector2 min = Vector2(fminf(position.x, end.x) - AGENT_RADIUS, fminf(position.y, end.y) - AGENT_RADIUS);
+    union Vector2 max = Vector2(fmaxf(position.x, end.x) + AGENT_RADIUS, fmaxf(position.y, end.y) + AGENT_RADIUS);
+    int x0 = to_bucket(min.x, navmesh->grid_origin.x, navmesh->grid_scale.x);
+    int x1 = to_bucket(max.x, navmesh->grid_origin.x, navmesh->grid_scale.x);
+    int y0 = to_bucket(min.y, navmesh->grid_origin.y, navmesh->grid_scale.y);
+    int y1 = to_bucket(max.y, navmesh->grid_origin.y, navmesh->grid_scale.y);
+
+    float start_time = *hit_time;
+    u64 tested = (u64)1 << cell_index;
+    for (int y=y0; y<=y1; y++) {
+	for (int x=x0; x<=x1; x++) {
+	    int bucket = y * NAVMESH_GRID_SIZE + x;
+	    for (int i=navmesh->bucket_starts[bucket]; i<navmesh->bucket_starts[bucket + 1]; i++) {
+		int other_index = navmesh->bucket_cells[i];
+		if (tested & ((u64)1 << other_index)) {
+		    continue;
+		}
+		tested |= (u64)1 << other_index;
+
+		struct Cell* cell = &navmesh->cells[other_index];
+		for (int edge_index=0; edge_index<3; edge_index++) {
+		    int e = other_index * 3 + edge_index;
+		    if (!is_wall_edge(area_id, edges, e)) {
+			continue;
+		    }
+
+		    union Vector2 a = cell->triangle.p[edge_index].xy;
+		    union Vector2 b = cell->triangle.p[(edge_index + 1) % 3].xy;
+		    union Vector2 normal = Vector2(edges->normals_x[e], edges->normals_y[e]);
+		    float approach = Dot2(normal, motion);
+		    float distance = Dot2(normal, position) - edges->offsets[e];
+		    if (approach < 0 && distance >= 0) {
+			float time = fmaxf((distance - AGENT_RADIUS) / -approach, 0);
+			union Vector2 along = Sub2(b, a);
+			float t = Dot2(Sub2(Add2(position, Scale2(motion, time)), a), along) / Dot2(along, along);
+			if (time < *hit_time && t >= 0 && t <= 1) {
+			    *hit_time = time;
+			    *hit_normal = normal;
+			}
+		    }
+		    reach_corner(position, motion, a, hit_time, hit_normal);
+		    reach_corner(position, motion, b, hit_time, hit_normal);
 		}
 	    }
 	}
+    }
+    return *hit_time < start_time;
+}
+
+
+/* Moves an agent along its velocity for one tick as a circle, walking
+   from cell to cell. Crossing into another cell or through a portal
+   carries on with whatever motion is left, and running into a wall
+   slides along it, so an agent can never end up on the far side of a
+   wall however fast it's going. */
+static void sweep_agent(Agent agent_id, float delta_time) {
+    union Vector2 position = Vector2(agents.positions_x[agent_id], agents.positions_y[agent_id]);
+    union Vector2 velocity = Vector2(agents.velocities_x[agent_id], agents.velocities_y[agent_id]);
+    union Vector2 motion = Scale2(velocity, delta_time);
+    Area area_id = agents.area_ids[agent_id];
+    int cell_index = agents.cell_indices[agent_id];
+
+    for (int sweep_count=0; sweep_count<MAX_SWEEP_COUNT; sweep_count++) {
+	struct Edges* edges = &navmeshes[area_id.base].edges;
+
+	/* Find the first edge the motion reaches. Walls are reached
+	   once the circle touches them, and everything else once the
+	   center crosses it */
+	float hit_time = 1.0f;
+	int hit_edge = -1;
+	int hit_is_wall = 0;
+	union Vector2 hit_normal = Vector2(0, 0);
+	for (int e=cell_index * 3; e<cell_index * 3 + 3; e++) {
+	    float approach = edges->normals_x[e] * motion.x + edges->normals_y[e] * motion.y;
+	    if (approach >= 0) {
+		continue;
+	    }
+
+	    int is_wall = is_wall_edge(area_id, edges, e);
 
-	if (hit.edge_index != -1) {
-	    switch(cell->connected_to[hit.edge_index]) {
-	    case NOTHING: {
-		union Vector2 normal = Normalize2(Vector2(-(hit.b.y - hit.a.y),
-							  hit.b.x - hit.a.x));
-		float distance = DistanceToLine2(position, Line2(hit.a, hit.b));
-		force = Add2(force, Scale2(normal, (distance + 0.01) * COLLISION_FORCE));
-		break;
+	    float distance = edges->normals_x[e] * position.x + edges->normals_y[e] * position.y - edges->offsets[e];
+	    float time = (distance - (is_wall ? AGENT_RADIUS : 0)) / -approach;
+	    if (time < 0) {
+		time = 0;
 	    }
-	    case CELL: {
-		agent->cell_index = cell->connection_index[hit.edge_index];
-		break;
+	    if (time < hit_time) {
+		hit_time = time;
+		hit_edge = e;
+		hit_is_wall = is_wall;
+		hit_normal = Vector2(edges->normals_x[e], edges->normals_y[e]);
 	    }
-	    case NETWORK: {
-		struct Network* network = get_network(agent->area_id);
-		struct Portal* out_portal = &network->portals[cell->connection_index[hit.edge_index]];
-		/* TODO Change the agent's area id */
-		network = get_network(out_portal->destination);
-		struct Portal* in_portal = &network->portals[out_portal->portal_index];
+	}
+	if (reach_nearby_walls(area_id, cell_index, position, motion, &hit_time, &hit_normal)) {
+	    hit_edge = -1;
+	    hit_is_wall = 1;
+	}
+
+	position = Add2(position, Scale2(motion, hit_time));
+	if (hit_edge == -1 && !hit_is_wall) {
+	    break;
+	}
+	motion = Scale2(motion, 1.0f - hit_time);
+
+	union Vector2 normal = hit_normal;
+	if (hit_is_wall) {
+	    /* Keep only the part of the motion along the wall */
+	    motion = Sub2(motion, Scale2(normal, Dot2(motion, normal)));
+	    float into_wall = Dot2(velocity, normal);
+	    if (into_wall < 0) {
+		velocity = Sub2(velocity, Scale2(normal, into_wall));
+	    }
+	} else if (edges->connected_to[hit_edge] == CELL) {
+	    cell_index = edges->connection_index[hit_edge];
+	} else {
+	    int portal_index = edges->connection_index[hit_edge];
+	    struct Portal* out_portal = &get_network(area_id)->portals[portal_index];
+	    const struct Link* link = get_link(area_id, portal_index);
+	    struct Portal* in_portal = &get_network(link->destination)->portals[link->portal_index];
+
+	    union Matrix4 transform = MulM4(in_portal->transform_in, InvertM4(out_portal->transform_out));
+	    position = Transform4(transform, Vector4(position.x, position.y, 0, 1)).xy;
+
+	    /* We do _not_ want to translate velocity, only scale and
+	       rotate it */
+	    transform.vectors[3] = Vector4(0, 0, 0, 1);
+	    velocity = Transform4(transform, Vector4(velocity.x, velocity.y, 0, 1)).xy;
+	    motion = Transform4(transform, Vector4(motion.x, motion.y, 0, 1)).xy;
+
+	    /* Portals only ever turn about the z axis, so the agent
+	       turns the opposite way by however much the portal
+	       turns things */
+	    agents.headings[agent_id] -= atan2f(transform.columns[0][1], transform.columns[0][0]);
+
+	    /* Occupancy is shared between threads, so it's settled
+	       once the whole tick is done */
+	    area_id = link->destination;
+	    cell_index = in_portal->cell_index;
+	}
+    }
+
+    agents.positions_x[agent_id] = position.x;
+    agents.positions_y[agent_id] = position.y;
+    agents.velocities_x[agent_id] = velocity.x;
+    agents.velocities_y[agent_id] = velocity.y;
+    agents.area_ids[agent_id] = area_id;
+    agents.cell_indices[agent_id] = cell_index;
+}
 
-		union Matrix4 transform = MulM4(in_portal->transform_in, InvertM4(out_portal->transform_out));
-		agent->position = Transform4(transform, Vector4(position.x, position.y, 0, 1)).xy;
 
-		/* We do _not_ want to translate acceleration and
-		   velocity, only scale and rotate them */
-		transform.vectors[3] = Vector4(0, 0, 0, 1);
-		agent->acceleration = Transform4(transform, Vector4(acceleration.x, acceleration.y, 0, 1)).xy;
-		agent->velocity = Transform4(transform, Vector4(velocity.x, velocity.y, 0, 1)).xy;
+/* Agents avoid each other by looking up their neighbors in a uniform
+   spatial hash. It's rebuilt at the start of every tick from copies of
+   the agents' positions, so it can be read from every worker while
+   the agents themselves move. Agents in different areas never see
+   each other, even where the areas overlap in space. */
+#define AGENT_HASH_CELL_SIZE (2.0f * AGENT_RADIUS)
+#define AGENT_HASH_BUCKET_COUNT 4096
+#define MAX_NEIGHBOR_COUNT 16
 
-		/* We invert the transform here. I'm not sure why, but
-		   it seems to work */
-		agent->rotation = MulM4(agent->rotation, InvertM4(transform));
 
-		agent->area_id = out_portal->destination;
-		agent->cell_index = in_portal->cell_index;
-		break;
-	    }
+static int hashed_agent_count = 0;
+static int bucket_starts[AGENT_HASH_BUCKET_COUNT + 1];
+static Agent hashed_agents[MAX_AGENT_COUNT];
+static Area hashed_area_ids[MAX_AGENT_COUNT];
+static float hashed_positions_x[MAX_AGENT_COUNT], hashed_positions_y[MAX_AGENT_COUNT];
+
+
+static int to_agent_hash_cell(float coordinate) {
+    return (int)floorf(coordinate / AGENT_HASH_CELL_SIZE);
+}
+
+
+static int to_agent_bucket(Area area_id, int x, int y) {
+    u32 h = (u32)x * 73856093u ^ (u32)y * 19349663u ^ area_id.id * 83492791u;
+    return h & (AGENT_HASH_BUCKET_COUNT - 1);
+}
+
+
+static void hash_agents(void) {
+    static int agent_buckets[MAX_AGENT_COUNT];
+
+    memset(bucket_starts, 0, sizeof(bucket_starts));
+    for (Agent i=0; i<agent_count; i++) {
+	agent_buckets[i] = to_agent_bucket(agents.area_ids[i],
+					   to_agent_hash_cell(agents.positions_x[i]),
+					   to_agent_hash_cell(agents.positions_y[i]));
+	bucket_starts[agent_buckets[i] + 1]++;
+    }
+    for (int b=0; b<AGENT_HASH_BUCKET_COUNT; b++) {
+	bucket_starts[b + 1] += bucket_starts[b];
+    }
+
+    static int bucket_ends[AGENT_HASH_BUCKET_COUNT];
+    memcpy(bucket_ends, bucket_starts, sizeof(bucket_ends));
+    for (Agent i=0; i<agent_count; i++) {
+	int j = bucket_ends[agent_buckets[i]]++;
+	hashed_agents[j] = i;
+	hashed_area_ids[j] = agents.area_ids[i];
+	hashed_positions_x[j] = agents.positions_x[i];
+	hashed_positions_y[j] = agents.positions_y[i];
+    }
+    hashed_agent_count = agent_count;
+}
+
+
+/* Finds where in the hash the agents near a position are, rather than
+   which agents they are, so callers can read their snapshot positions */
+static int find_hashed_agents(Area area_id, union Vector2 position, float radius, int found[], int max_count) {
+    int found_count = 0;
+    float radius_squared = radius * radius;
+
+    int min_x = to_agent_hash_cell(position.x - radius), max_x = to_agent_hash_cell(position.x + radius);
+    int min_y = to_agent_hash_cell(position.y - radius), max_y = to_agent_hash_cell(position.y + radius);
+    for (int y=min_y; y<=max_y; y++) {
+	for (int x=min_x; x<=max_x; x++) {
+	    int b = to_agent_bucket(area_id, x, y);
+	    for (int j=bucket_starts[b]; j<bucket_starts[b + 1]; j++) {
+		/* Buckets are shared with whatever else hashes the same */
+		if (hashed_area_ids[j].id != area_id.id) {
+		    continue;
+		}
+
+		float dx = hashed_positions_x[j] - position.x;
+		float dy = hashed_positions_y[j] - position.y;
+		if (dx * dx + dy * dy > radius_squared) {
+		    continue;
+		}
+
+		found[found_count++] = j;
+		if (found_count == max_count) {
+		    return found_count;
+		}
 	    }
+	}
+    }
+
+    return found_count;
+}
+
+
+static void separate_agent(Agent agent_id) {
+    /* Agents spawned since the hash was built aren't in it yet */
+    if (agent_id >= hashed_agent_count) {
+	return;
+    }
+
+    union Vector2 position = Vector2(agents.positions_x[agent_id], agents.positions_y[agent_id]);
+    int neighbors[MAX_NEIGHBOR_COUNT + 1];
+    int neighbor_count = find_hashed_agents(agents.area_ids[agent_id], position, 2.0f * AGENT_RADIUS,
+					    neighbors, MAX_NEIGHBOR_COUNT + 1);
+
+    union Vector2 force = Vector2(0, 0);
+    for (int n=0; n<neighbor_count; n++) {
+	int j = neighbors[n];
+	Agent other = hashed_agents[j];
+	if (other == agent_id) {
+	    continue;
+	}
+
+	/* Push away from each neighbor in proportion to how much the
+	   two overlap */
+	union Vector2 away = Vector2(position.x - hashed_positions_x[j],
+				     position.y - hashed_positions_y[j]);
+	float distance = Magnitude2(away);
+	if (distance > 0.0001f) {
+	    away = Scale2(away, 1.0f / distance);
 	} else {
-	    break;
+	    /* Agents stacked right on top of each other split up in
+	       opposite directions that only depend on who they are */
+	    Agent lower = agent_id < other ? agent_id : other;
+	    float angle = (float)(lower % 1024) * 2.39996f;
+	    away = Scale2(Vector2(cosf(angle), sinf(angle)), agent_id == lower ? 1.0f : -1.0f);
 	}
+	force = Add2(force, Scale2(away, (2.0f * AGENT_RADIUS - distance) * SEPARATION_FORCE));
+    }
+
+    agents.forces_x[agent_id] += force.x;
+    agents.forces_y[agent_id] += force.y;
+}
+
+
+static void step_agents(const Agent agent_ids[], int count, float delta_time) {
+    for (int j=0; j<count; j++) {
+	steer_agent(agent_ids[j]);
+    }
+
+    /* Start with the goal force, and factor in friction based on each
+       agent's velocity */
+    for (int j=0; j<count; j++) {
+	Agent i = agent_ids[j];
+	agents.forces_x[i] = agents.goals_x[i] - agents.velocities_x[i] * FRICTION_FORCE;
+	agents.forces_y[i] = agents.goals_y[i] - agents.velocities_y[i] * FRICTION_FORCE;
+    }
+
+    for (int j=0; j<count; j++) {
+	separate_agent(agent_ids[j]);
     }
 
     /* I'm not sure this works right for objects with masses other than 1.0 */
-    agent->acceleration = Scale2(force, 1.0 / agent->mass);
-    agent->velocity = Add2(agent->velocity, Scale2(agent->acceleration, delta_time));
-    agent->position = Add2(agent->position, Scale2(agent->velocity, delta_time));
+    for (int j=0; j<count; j++) {
+	Agent i = agent_ids[j];
+	agents.velocities_x[i] += agents.forces_x[i] * agents.inverse_masses[i] * delta_time;
+	agents.velocities_y[i] += agents.forces_y[i] * agents.inverse_masses[i] * delta_time;
+    }
+
+    /* Collisions depend on where each agent is, so they can't be
+       done in lockstep */
+    for (int j=0; j<count; j++) {
+	sweep_agent(agent_ids[j], delta_time);
+    }
+}
+
+
+/* Agents are stepped in partitions, one per area instance (plus one
+   for agents standing in base areas). An agent only ever reads the
+   navmesh and network, which don't change during a tick, and writes
+   its own entries, so partitions can be stepped in parallel without
+   locks. Big partitions get split into several jobs. */
+#define PARTITION_COUNT (MAX_INSTANCED_AREA_COUNT + 1)
+#define MAX_AGENTS_PER_JOB 512
+#define MAX_AGENT_JOB_COUNT (MAX_AGENT_COUNT / MAX_AGENTS_PER_JOB + PARTITION_COUNT)
+
+
+static Area departures[MAX_AGENT_COUNT];
+static Agent partitioned_agents[MAX_AGENT_COUNT];
+static int agent_job_count;
+static struct {
+    int first, count;
+} agent_jobs[MAX_AGENT_JOB_COUNT];
+
+
+static int get_partition(Area area_id) {
+    return area_id.instance < MAX_INSTANCED_AREA_COUNT ? area_id.instance : MAX_INSTANCED_AREA_COUNT;
+}
+
+
+static void partition_agents(void) {
+    int partition_starts[PARTITION_COUNT + 1] = {0};
+    for (Agent i=0; i<agent_count; i++) {
+	partition_starts[get_partition(agents.area_ids[i]) + 1]++;
+    }
+    for (int p=0; p<PARTITION_COUNT; p++) {
+	partition_starts[p + 1] += partition_starts[p];
+    }
+
+    int partition_ends[PARTITION_COUNT];
+    memcpy(partition_ends, partition_starts, sizeof(partition_ends));
+    for (Agent i=0; i<agent_count; i++) {
+	departures[i] = agents.area_ids[i];
+	partitioned_agents[partition_ends[get_partition(agents.area_ids[i])]++] = i;
+    }
+
+    agent_job_count = 0;
+    for (int p=0; p<PARTITION_COUNT; p++) {
+	for (int first=partition_starts[p]; first<partition_starts[p + 1]; first+=MAX_AGENTS_PER_JOB) {
+	    int count = partition_starts[p + 1] - first;
+	    agent_jobs[agent_job_count].first = first;
+	    agent_jobs[agent_job_count].count = count < MAX_AGENTS_PER_JOB ? count : MAX_AGENTS_PER_JOB;
+	    agent_job_count++;
+	}
+    }
+}
+
+
+static void step_agent_job(int job_index, int worker_index, void* data) {
+    float delta_time = *(float*)data;
+    step_agents(&partitioned_agents[agent_jobs[job_index].first],
+		agent_jobs[job_index].count, delta_time);
+}
+
+
+/* Agents that crossed a portal during the tick migrate to the
+   partition of their new area here, after the workers are done */
+static void settle_agents(const Agent agent_ids[], int count) {
+    for (int j=0; j<count; j++) {
+	Agent i = agent_ids[j];
+	if (departures[i].id != agents.area_ids[i].id) {
+	    occupy(departures[i], -1);
+	    occupy(agents.area_ids[i], 1);
+	}
+    }
+}
+
+
+void StepAgents(float delta_time) {
+    partition_agents();
+    hash_agents();
+    RunJobs(agent_job_count, step_agent_job, &delta_time);
+    settle_agents(partitioned_agents, agent_count);
+}
+
+
+void MoveAgent(Agent agent_id, union Vector2 goal, float delta_time) {
+    SetAgentGoal(agent_id, goal, GetMoveScalar());
+    departures[agent_id] = agents.area_ids[agent_id];
+    step_agents(&agent_id, 1, delta_time);
+    settle_agents(&agent_id, 1);
 }
 
 
 Area GetAgentArea(Agent id) {
-    return agents[id].area_id;
+    return agents.area_ids[id];
+}
+
+
+int GetAgentCell(Agent id) {
+    return agents.cell_indices[id];
+}
+
+
+static union Vector2 get_agent_position(Agent id) {
+    return Vector2(agents.positions_x[id], agents.positions_y[id]);
 }
 
 
 union Vector3 GetAgentPosition(Agent id) {
-    struct Agent* agent = &agents[id];
-    union Triangle3 triangle = navmeshes[agent->area_id.base].cells[agent->cell_index].triangle;
+    union Triangle3 triangle = navmeshes[agents.area_ids[id].base].cells[agents.cell_indices[id]].triangle;
 
-    return From2To3(agent->position, triangle.a, triangle.b, triangle.c);
+    return From2To3(get_agent_position(id), triangle.a, triangle.b, triangle.c);
 }
 
 
 union Matrix4 GetAgentRotation(Agent id) {
-    return agents[id].rotation;
+    return Rotation(AxisAngle(Vector3(0, 0, 1), agents.headings[id]));
+}
+
+
+float GetAgentHeading(Agent id) {
+    return agents.headings[id];
 }
 
 
 void DrawAgent(Agent id, float radius) {
-    struct Agent* agent = &agents[id];
-    union Triangle3 triangle = navmeshes[agent->area_id.base].cells[agent->cell_index].triangle;
+    union Vector2 position = get_agent_position(id);
+    struct Navmesh* navmesh = &navmeshes[agents.area_ids[id].base];
+    union Triangle3 triangle = navmesh->cells[agents.cell_indices[id]].triangle;
 
+    rtBindVertexArray(SCENERY_VERTEX_ARRAY);
     imModel(Matrix4(1));
-    imColor3ub(255, 255, 0);
-    imBegin(GL_LINE_LOOP); {
-	imVertex3(triangle.a);
-	imVertex3(triangle.b);
-	imVertex3(triangle.c);
-    } imEnd();
-
-    if (InsideTriangle2(agent->position, triangle.a.xy, triangle.b.xy, triangle.c.xy)) {
-	imColor3ub(0, 255, 255);
+    rtDrawArrays(GL_LINES, get_cell_outline(navmesh->highlight_mesh, agents.cell_indices[id]));
+
+    imModel(MulM4(Translation(From2To3(position, triangle.a, triangle.b, triangle.c)),
+		  Scale(Vector3(radius, radius, radius))));
+    if (InsideTriangle2(position, triangle.a.xy, triangle.b.xy, triangle.c.xy)) {
+	rtDrawArrays(GL_LINES, agent_inside_mesh);
     } else {
-	imColor3ub(255, 127, 0);
+	rtDrawArrays(GL_LINES, agent_outside_mesh);
     }
-
-    imModel(Translation(From2To3(agent->position, triangle.a, triangle.b, triangle.c)));
-    imBegin(GL_LINE_LOOP); {
-	imVertex2f(0, radius);
-	imVertex2f(radius, 0);
-	imVertex2f(0, -radius);
-	imVertex2f(-radius, 0);
-    } imEnd();
 }
@@ -5,10 +5,13 @@
 #include "ladder.h"
 #include "mathematics.h"
 #include "numbers.h"
+#include "random.h"
 
 
 #define MAX_BASE_AREA_COUNT 32
 #define MAX_INSTANCED_AREA_COUNT 64
+#define MAX_CELL_COUNT 64
+#define MAX_PORTAL_COUNT 8
 
 
 extern GLuint64 SCENERY_VERTEX_ARRAY;
@@ -27,7 +30,7 @@ typedef union Area {
 
 Area LoadArea(const char* filepath);
 Area InstanceArea(const Area base);
-void InstanceAreas(int count);
+void GrowWorld(Area around, int depth);
 Area GetArea(u16 index);
 Area GetAreaInstance(u16 index);
 
@@ -36,24 +39,66 @@ void LoadLightGrid(Area id, const char* filepath);
 
 
 void LoadNavmesh(Area id, const char* filepath);
+int LocateCell(Area id, union Vector2 point);
+union Vector2 GetRandomNavmeshPoint(Area id, struct Random* random);
+int GetCellCount(Area id);
+union Triangle3 GetCellTriangle(Area id, int cell_index);
+int GetCellNeighbor(Area id, int cell_index, int edge_index, Area* neighbor_area, int* neighbor_index);
+int GetCellPortal(Area id, int cell_index, int edge_index);
 void DrawNavmesh(Area id);
 
 
 void LoadNetwork(Area id, const char* filepath);
 void InstanceNetwork(Area id);
-void LinkInstancedNetworks(void);
+int GetPortalCount(Area id);
+union Vector2 GetPortalPosition(Area id, int portal_index);
+int GetPortalLink(Area id, int portal_index, Area* destination, int* destination_portal_index);
+u32 GetWorldVersion(void);
 void DrawNetwork(Area id);
 
 
+/* Where every instance's portals lead. It's the only part of the
+   world that changes as it grows, and small enough to copy whole */
+struct Link {
+    Area destination;
+    u8 portal_index;
+};
+
+
+struct LinkTable {
+    struct Link links[MAX_INSTANCED_AREA_COUNT][MAX_PORTAL_COUNT];
+};
+
+
+void CopyLinkTable(struct LinkTable* table);
+void DrawWithLinkTable(const struct LinkTable* table);
+
+
+void BatchScenery(int enabled);
+void CullPortals(int enabled);
 void LoadScenery(Area id, const char* filepath);
 void DrawScenery(Area id);
-void DrawSceneryRecursively(Area id, int portal_index, union Matrix4 view, int depth);
+/* `cell_index` is the cell the view is from, or -1 if it's unknown,
+   in which case every portal is considered */
+void DrawSceneryRecursively(Area id, int portal_index, int cell_index,
+			    union Matrix4 projection, union Matrix4 view, int depth);
+void SetPortalCutoff(GLsizei width, GLsizei height, float pixels, float distance);
+int GetOccludedSubtreeCount(void);
+void CreateImpostors(int depth, GLuint framebuffer, GLsizei width, GLsizei height);
 
 
 typedef u32 Agent;
+#define INVALID_AGENT U32_MAX
 Agent SpawnAgent(Area area);
+int GetAgentCount(void);
+void SetAgentGoal(Agent agent, union Vector2 goal, float speed);
+void SetAgentDestination(Agent agent, Area area, union Vector2 destination, float speed);
+void SetAgentWandering(Agent agent, float speed);
+void StepAgents(float delta_time);
 void MoveAgent(Agent agent, union Vector2 goal, float delta_time);
 union Vector3 GetAgentPosition(Agent agent);
 union Matrix4 GetAgentRotation(Agent agent);
+float GetAgentHeading(Agent agent);
 Area GetAgentArea(Agent agent);
+int GetAgentCell(Agent agent);
 void DrawAgent(Agent agent, float radius);
@@ -12,15 +12,133 @@ static float move_scalar = MOVE_LOW;
 static union Vector2 move = { .x=0, .y=0 };
 
 
-void PollEvents(void) {
+/* SDL wants events polled on the main thread, but the simulation
+   might run on another one. Polling only records what happened, in a
+   queue with one writer and one reader, and the inputs only change
+   once the simulation takes them out of it. */
+#define INPUT_QUEUE_SIZE 1024
+
+
+/* In the order pending inputs go into the queue */
+enum InputKind {
+    INPUT_RELEASE,
+    INPUT_MOVE,
+    INPUT_MOVE_SCALAR,
+    INPUT_LOOK,
+    INPUT_KIND_COUNT,
+};
+
+
+struct Input {
+    enum InputKind kind;
+    union Vector2 value;
+};
+
+
+static struct Input inputs[INPUT_QUEUE_SIZE];
+static SDL_atomic_t input_head;
+static SDL_atomic_t input_tail;
+
+
+/* Nothing is ever dropped when the queue is full, or a lost key up
+   would leave the player walking forever. Inputs wait here instead,
+   merged into at most one of each kind, which works because moves and
+   looks add up, the newest move scalar wins, and a release undoes
+   everything before it. Only the polling thread touches these. */
+static struct Input pending_inputs[INPUT_KIND_COUNT];
+static SDL_bool is_pending[INPUT_KIND_COUNT];
+
+
+static SDL_bool enqueue_input(struct Input input) {
+    int head = SDL_AtomicGet(&input_head);
+    if (head - SDL_AtomicGet(&input_tail) == INPUT_QUEUE_SIZE) {
+	return SDL_FALSE;
+    }
+
+    inputs[head % INPUT_QUEUE_SIZE] = input;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&input_head, head + 1);
+    return SDL_TRUE;
+}
+
+
+static SDL_bool flush_inputs(void) {
+    for (int kind=0; kind<INPUT_KIND_COUNT; kind++) {
+	if (is_pending[kind]) {
+	    if (!enqueue_input(pending_inputs[kind])) {
+		return SDL_FALSE;
+	    }
+	    is_pending[kind] = SDL_FALSE;
+	}
+    }
+    return SDL_TRUE;
+}
+
+
+static void push_input(enum InputKind kind, union Vector2 value) {
+    if (flush_inputs() && enqueue_input((struct Input) { .kind=kind, .value=value })) {
+	return;
+    }
+
+    struct Input* pending = &pending_inputs[kind];
+    if (!is_pending[kind] || kind == INPUT_MOVE_SCALAR) {
+	*pending = (struct Input) { .kind=kind, .value=value };
+    } else if (kind != INPUT_RELEASE) {
+	pending->value = Add2(pending->value, value);
+    }
+    is_pending[kind] = SDL_TRUE;
+
+    if (kind == INPUT_RELEASE) {
+	is_pending[INPUT_MOVE] = SDL_FALSE;
+	is_pending[INPUT_MOVE_SCALAR] = SDL_FALSE;
+    }
+}
+
+
+void ConsumeInputs(void) {
     look = Vector2(0, 0);
 
+    int tail = SDL_AtomicGet(&input_tail);
+    int head = SDL_AtomicGet(&input_head);
+    SDL_MemoryBarrierAcquire();
+    for (; tail != head; tail++) {
+	struct Input* input = &inputs[tail % INPUT_QUEUE_SIZE];
+	switch (input->kind) {
+	case INPUT_RELEASE:
+	    move = Vector2(0, 0);
+	    move_scalar = MOVE_LOW;
+	    break;
+	case INPUT_MOVE:
+	    move = Add2(move, input->value);
+	    break;
+	case INPUT_LOOK:
+	    look = Add2(look, input->value);
+	    break;
+	case INPUT_MOVE_SCALAR:
+	    move_scalar = input->value.x;
+	    break;
+	default:
+	    break;
+	}
+    }
+    SDL_AtomicSet(&input_tail, tail);
+}
+
+
+void PollEvents(void) {
     SDL_Event e;
     while (SDL_PollEvent(&e)) {
 	switch (e.type) {
 	case SDL_QUIT:
 	    has_quit = SDL_TRUE;
 	    break;
+	case SDL_WINDOWEVENT:
+	    /* Keys let go of while the window is away never come back
+	       up, so let go of all of them */
+	    if (e.window.event == SDL_WINDOWEVENT_FOCUS_LOST) {
+		push_input(INPUT_RELEASE, Vector2(0, 0));
+	    }
+	    break;
 	case SDL_KEYDOWN:
 	    if (e.key.repeat) {
 		/* pass */
@@ -30,19 +148,19 @@ void PollEvents(void) {
 		    has_quit = SDL_TRUE;
 		    break;
                 case SDLK_w:
-                    move.y += 1;
+		    push_input(INPUT_MOVE, Vector2(0, 1));
                     break;
                 case SDLK_s:
-                    move.y -= 1;
+		    push_input(INPUT_MOVE, Vector2(0, -1));
                     break;
                 case SDLK_a:
-                    move.x -= 1;
+		    push_input(INPUT_MOVE, Vector2(-1, 0));
                     break;
                 case SDLK_d:
-                    move.x += 1;
+		    push_input(INPUT_MOVE, Vector2(1, 0));
                     break;
 		case SDLK_LSHIFT:
-		    move_scalar = MOVE_HIGH;
+		    push_input(INPUT_MOVE_SCALAR, Vector2(MOVE_HIGH, 0));
 		    break;
 		default:
 		    break;
@@ -55,19 +173,19 @@ void PollEvents(void) {
 	    } else {
 		switch (e.key.keysym.sym) {
 		case SDLK_w:
-		    move.y -= 1;
+		    push_input(INPUT_MOVE, Vector2(0, -1));
 		    break;
 		case SDLK_s:
-		    move.y += 1;
+		    push_input(INPUT_MOVE, Vector2(0, 1));
 		    break;
 		case SDLK_a:
-		    move.x += 1;
+		    push_input(INPUT_MOVE, Vector2(1, 0));
 		    break;
 		case SDLK_d:
-		    move.x -= 1;
+		    push_input(INPUT_MOVE, Vector2(-1, 0));
 		    break;
 		case SDLK_LSHIFT:
-		    move_scalar = MOVE_LOW;
+		    push_input(INPUT_MOVE_SCALAR, Vector2(MOVE_LOW, 0));
 		    break;
 		default:
 		    break;
@@ -75,12 +193,13 @@ void PollEvents(void) {
 	    }
             break;
         case SDL_MOUSEMOTION:
-            look = Add2(look, Vector2(e.motion.xrel, e.motion.yrel));
+	    push_input(INPUT_LOOK, Vector2(e.motion.xrel, e.motion.yrel));
             break;
 	default:
 	    break;
 	}
     }
+    flush_inputs();
 }
 
 
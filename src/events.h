@@ -6,6 +6,7 @@
 
 
 void PollEvents(void);
+void ConsumeInputs(void);
 
 
 SDL_bool HasQuit(void);
@@ -10,8 +10,8 @@ struct Framebuffer CreateFramebuffer(int x, int y) {
     glGenTextures(2, &framebuffer.color);
     glGenFramebuffers(1, &framebuffer.buffer);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer.buffer); {
-	glBindTexture(GL_TEXTURE_2D, framebuffer.color); {
+    glsBindFramebuffer(GL_FRAMEBUFFER, framebuffer.buffer); {
+	glsBindTexture(GL_TEXTURE_2D, framebuffer.color); {
             glTexImage2D(GL_TEXTURE_2D,
                          0, GL_RGB,
                          framebuffer.resolution.x, framebuffer.resolution.y,
@@ -20,9 +20,9 @@ struct Framebuffer CreateFramebuffer(int x, int y) {
                          NULL);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        } glBindTexture(GL_TEXTURE_2D, 0);
+        } glsBindTexture(GL_TEXTURE_2D, 0);
 
-        glBindTexture(GL_TEXTURE_2D, framebuffer.depth); {
+        glsBindTexture(GL_TEXTURE_2D, framebuffer.depth); {
             glTexImage2D(GL_TEXTURE_2D,
                          0, GL_DEPTH24_STENCIL8,
                          framebuffer.resolution.x, framebuffer.resolution.y,
@@ -32,7 +32,7 @@ struct Framebuffer CreateFramebuffer(int x, int y) {
                          NULL);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);           
-        } glBindTexture(GL_TEXTURE_2D, 0);
+        } glsBindTexture(GL_TEXTURE_2D, 0);
 
         glLogErrors();
 
@@ -52,7 +52,7 @@ struct Framebuffer CreateFramebuffer(int x, int y) {
         if (framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
             Warn("Unable to complete framebuffer because %d\n", framebuffer_status);
         }
-    } glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    } glsBindFramebuffer(GL_FRAMEBUFFER, 0);
 
     return framebuffer;
 }
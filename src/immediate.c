@@ -4,6 +4,8 @@
 
 #include "logger.h"
 #include "stdlib_plus.h"
+#include "workers.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -27,14 +29,14 @@ void imInitTransformBuffer(void) {
     {
 	glGenBuffers(1, &MATRICES.id);
 
-	glBindBuffer(GL_UNIFORM_BUFFER, MATRICES.id); {
+	glsBindBuffer(GL_UNIFORM_BUFFER, MATRICES.id); {
 	    glBufferData(GL_UNIFORM_BUFFER,
 			 MATRICES.size,
 			 NULL,
 			 GL_DYNAMIC_DRAW);
-	} glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	} glsBindBuffer(GL_UNIFORM_BUFFER, 0);
 	
-	glBindBufferBase(GL_UNIFORM_BUFFER,
+	glsBindBufferBase(GL_UNIFORM_BUFFER,
 			 MATRICES.bind,
 			 MATRICES.id);
     }
@@ -42,14 +44,14 @@ void imInitTransformBuffer(void) {
     {
 	glGenBuffers(1, &LIGHTS.id);
     
-	glBindBuffer(GL_UNIFORM_BUFFER, LIGHTS.id); {
+	glsBindBuffer(GL_UNIFORM_BUFFER, LIGHTS.id); {
 	    glBufferData(GL_UNIFORM_BUFFER,
 			 LIGHTS.size,
 			 NULL,
 			 GL_DYNAMIC_DRAW);
-	} glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	} glsBindBuffer(GL_UNIFORM_BUFFER, 0);
 
-	glBindBufferBase(GL_UNIFORM_BUFFER,
+	glsBindBufferBase(GL_UNIFORM_BUFFER,
 			 LIGHTS.bind,
 			 LIGHTS.id);
     }
@@ -61,17 +63,7 @@ void imInitTransformBuffer(void) {
 #define VERTEX_MAX_COUNT U16_MAX
 
 
-struct Vertex {
-    union Vector3 position;
-    union Vector3 normal;
-    union Vector4 color;
-    union Vector2 texcoord;
-};
-
-
-static GLuint vertex_count;
-static struct Vertex vertices[VERTEX_MAX_COUNT];
-static struct Vertex current_vertex;
+static THREAD_LOCAL struct Vertex current_vertex;
 
 
 static GLuint64 internal_vertex_array;
@@ -87,23 +79,34 @@ void imBindVertexArray(void) {
 }
 
 
-#define COMMAND_MAX_COUNT 4096
-
-
 enum CommandType {
     COMMAND_ACTIVE_TEXTURE,
     COMMAND_ANY,
+    COMMAND_BEGIN_QUERY,
+    COMMAND_BIND_FRAMEBUFFER,
     COMMAND_BIND_TEXTURE,
+    COMMAND_BIND_VERTEX_ARRAY,
     COMMAND_CLEAR,
+    COMMAND_COLOR_MASK,
+    COMMAND_DEPTH_FUNC,
+    COMMAND_DEPTH_MASK,
+    COMMAND_DISABLE,
     COMMAND_DRAW_COLOR,
     COMMAND_DRAW_STENCIL,
+    COMMAND_ENABLE,
+    COMMAND_END_QUERY,
+    COMMAND_FILL_BUFFER,
     COMMAND_INSTANCED_PRIMITIVE,
     COMMAND_MODEL,
     COMMAND_PRIMITIVE,
     COMMAND_PROGRAM,
     COMMAND_PROJECTION,
     COMMAND_SET_LIGHTS,
+    COMMAND_STENCIL_FUNC,
+    COMMAND_STENCIL_OP,
     COMMAND_VIEW,
+    COMMAND_VIEWPORT,
+    COMMAND_TYPE_COUNT,
 };
 
 
@@ -113,14 +116,40 @@ struct Command {
         struct {
             GLenum texture;
         } active_texture;
+	struct {
+	    GLuint index;
+	    GLuint frame;
+	} begin_query;
+	struct {
+	    GLuint id;
+	} bind_framebuffer;
         struct {
             GLenum target;
             GLuint id;
             GLenum slot;
         } bind_texture;
+	struct {
+	    GLuint64 id;
+	} bind_vertex_array;
 	struct {
 	    GLbitfield mask;
 	} clear;
+	struct {
+	    GLboolean r, g, b, a;
+	} color_mask;
+	struct {
+	    GLenum func;
+	} depth_func;
+	struct {
+	    GLboolean flag;
+	} depth_mask;
+	struct {
+	    GLenum cap;
+	} capability;
+	struct {
+	    GLuint first;
+	    GLuint count;
+	} fill_buffer;
         union Matrix4 model;
         struct {
             GLuint vertex_array;
@@ -136,17 +165,142 @@ struct Command {
 	struct {
 	    void* data;
 	} set_lights;
+	struct {
+	    GLenum func;
+	    GLint ref;
+	    GLuint mask;
+	} stencil_func;
+	struct {
+	    GLenum sfail, dpfail, dppass;
+	} stencil_op;
         union Matrix4 view;
+	struct {
+	    GLint x, y;
+	    GLsizei width, height;
+	} viewport;
     };
 };
 
 
-static GLuint command_count;
-static struct Command commands[COMMAND_MAX_COUNT];
-static struct Command current_command;
+/* Commands are packed one after another, each as a small header
+   followed by only as much of the union as its type uses. They're
+   unpacked into a whole struct Command again to be played back. */
+struct CommandHeader {
+    u16 type;
+    u16 size;
+};
+
+
+#define PAYLOAD_OFFSET offsetof(struct Command, model)
+#define PAYLOAD_SIZE(member) sizeof(((struct Command*)0)->member)
+
+
+static const u16 payload_sizes[COMMAND_TYPE_COUNT] = {
+    [COMMAND_ACTIVE_TEXTURE]=PAYLOAD_SIZE(active_texture),
+    [COMMAND_ANY]=0,
+    [COMMAND_BEGIN_QUERY]=PAYLOAD_SIZE(begin_query),
+    [COMMAND_BIND_FRAMEBUFFER]=PAYLOAD_SIZE(bind_framebuffer),
+    [COMMAND_BIND_TEXTURE]=PAYLOAD_SIZE(bind_texture),
+    [COMMAND_BIND_VERTEX_ARRAY]=PAYLOAD_SIZE(bind_vertex_array),
+    [COMMAND_CLEAR]=PAYLOAD_SIZE(clear),
+    [COMMAND_COLOR_MASK]=PAYLOAD_SIZE(color_mask),
+    [COMMAND_DEPTH_FUNC]=PAYLOAD_SIZE(depth_func),
+    [COMMAND_DEPTH_MASK]=PAYLOAD_SIZE(depth_mask),
+    [COMMAND_DISABLE]=PAYLOAD_SIZE(capability),
+    [COMMAND_DRAW_COLOR]=0,
+    [COMMAND_DRAW_STENCIL]=0,
+    [COMMAND_ENABLE]=PAYLOAD_SIZE(capability),
+    [COMMAND_END_QUERY]=0,
+    [COMMAND_FILL_BUFFER]=PAYLOAD_SIZE(fill_buffer),
+    [COMMAND_INSTANCED_PRIMITIVE]=PAYLOAD_SIZE(primitive),
+    [COMMAND_MODEL]=PAYLOAD_SIZE(model),
+    [COMMAND_PRIMITIVE]=PAYLOAD_SIZE(primitive),
+    [COMMAND_PROGRAM]=PAYLOAD_SIZE(program),
+    [COMMAND_PROJECTION]=PAYLOAD_SIZE(projection),
+    [COMMAND_SET_LIGHTS]=PAYLOAD_SIZE(set_lights),
+    [COMMAND_STENCIL_FUNC]=PAYLOAD_SIZE(stencil_func),
+    [COMMAND_STENCIL_OP]=PAYLOAD_SIZE(stencil_op),
+    [COMMAND_VIEW]=PAYLOAD_SIZE(view),
+    [COMMAND_VIEWPORT]=PAYLOAD_SIZE(viewport),
+};
 
 
-static enum CommandType current_mode = COMMAND_ANY;
+/* A list's memory is kept from frame to frame, and only ever grows,
+   so after the first few frames recording doesn't allocate at all */
+#define INITIAL_COMMAND_LIST_CAPACITY (64 * 1024)
+
+
+struct CommandList {
+    size_t size;
+    size_t capacity;
+    u8* bytes;
+};
+
+
+static int reserve(struct CommandList* list, size_t size) {
+    if (list->size + size <= list->capacity) {
+	return 1;
+    }
+
+    size_t capacity = list->capacity ? list->capacity : INITIAL_COMMAND_LIST_CAPACITY;
+    while (capacity < list->size + size) {
+	capacity *= 2;
+    }
+
+    u8* bytes = realloc(list->bytes, capacity);
+    if (!bytes) {
+	Err("Unable to grow a command list to %zu bytes, so commands are being dropped\n", capacity);
+	return 0;
+    }
+
+    list->bytes = bytes;
+    list->capacity = capacity;
+    return 1;
+}
+
+
+static void push_command(struct CommandList* list, const struct Command* command) {
+    struct CommandHeader header = { .type=command->type, .size=payload_sizes[command->type] };
+    if (!reserve(list, sizeof(header) + header.size)) {
+	return;
+    }
+
+    memcpy(list->bytes + list->size, &header, sizeof(header));
+    memcpy(list->bytes + list->size + sizeof(header), (const u8*)command + PAYLOAD_OFFSET, header.size);
+    list->size += sizeof(header) + header.size;
+}
+
+
+/* Everything recorded for a frame, commands and vertices alike. There
+   are two, so that one can be recorded while the render thread plays
+   the other back. */
+struct Stream {
+    struct CommandList list;
+    GLuint vertex_count;
+    GLuint filled_vertex_count;
+    struct Vertex vertices[VERTEX_MAX_COUNT];
+};
+
+
+static struct Stream streams[2];
+static struct Stream* recording = &streams[0];
+
+
+/* Parts of a frame can also be recorded on other threads, each into a
+   command list of its own, and appended to the frame afterwards in
+   whatever order they need to be drawn in. Everything about what's
+   being recorded is kept per thread for that reason. */
+static struct CommandList command_lists[MAX_COMMAND_LIST_COUNT];
+static THREAD_LOCAL struct CommandList* listing = NULL;
+static THREAD_LOCAL struct Command current_command;
+
+
+static THREAD_LOCAL enum CommandType current_mode = COMMAND_ANY;
+
+
+/* Set whenever a vertex doesn't fit in the stream, since a stream
+   filled to the last vertex looks just the same as one that ran out */
+static THREAD_LOCAL int dropped_vertices = 0;
 
 
 #define MODE_MUST_BE(mode)                      \
@@ -158,10 +312,37 @@ static enum CommandType current_mode = COMMAND_ANY;
         return err;                             \
     }
 #define ADVANCE_COMMAND() \
-    if (command_count < COMMAND_MAX_COUNT) {            \
-        commands[command_count++] = current_command;     \
+    push_command(listing ? listing : &recording->list, &current_command);
+
+
+void imBeginCommandList(int index) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    listing = &command_lists[index];
+    listing->size = 0;
+}
+
+
+void imEndCommandList(void) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    listing = NULL;
+}
+
+
+void imAppendCommandList(int index) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    struct CommandList* list = listing ? listing : &recording->list;
+    struct CommandList* appended = &command_lists[index];
+    if (!reserve(list, appended->size)) {
+	return;
     }
 
+    memcpy(list->bytes + list->size, appended->bytes, appended->size);
+    list->size += appended->size;
+}
+
 
 void imClear(GLbitfield mask) {
     MODE_MUST_BE(COMMAND_ANY);
@@ -173,6 +354,106 @@ void imClear(GLbitfield mask) {
 }
 
 
+void imBindFramebuffer(GLuint framebuffer) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_BIND_FRAMEBUFFER;
+    current_command.bind_framebuffer.id = framebuffer;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_VIEWPORT;
+    current_command.viewport.x = x;
+    current_command.viewport.y = y;
+    current_command.viewport.width = width;
+    current_command.viewport.height = height;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imEnable(GLenum cap) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_ENABLE;
+    current_command.capability.cap = cap;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imDisable(GLenum cap) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_DISABLE;
+    current_command.capability.cap = cap;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_COLOR_MASK;
+    current_command.color_mask.r = r;
+    current_command.color_mask.g = g;
+    current_command.color_mask.b = b;
+    current_command.color_mask.a = a;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imDepthMask(GLboolean flag) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_DEPTH_MASK;
+    current_command.depth_mask.flag = flag;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imDepthFunc(GLenum func) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_DEPTH_FUNC;
+    current_command.depth_func.func = func;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imStencilFunc(GLenum func, GLint ref, GLuint mask) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_STENCIL_FUNC;
+    current_command.stencil_func.func = func;
+    current_command.stencil_func.ref = ref;
+    current_command.stencil_func.mask = mask;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imStencilOp(GLenum sfail, GLenum dpfail, GLenum dppass) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_STENCIL_OP;
+    current_command.stencil_op.sfail = sfail;
+    current_command.stencil_op.dpfail = dpfail;
+    current_command.stencil_op.dppass = dppass;
+
+    ADVANCE_COMMAND();
+}
+
+
 void imDrawColor(void) {
     MODE_MUST_BE(COMMAND_ANY);
 
@@ -191,6 +472,32 @@ void imDrawStencil(void) {
 }
 
 
+/* Counts whether any samples pass until imEndQuery. The result comes
+   back frames later, tagged with `frame` so it can be told apart from
+   whatever the query was last used for. */
+void imBeginQuery(int index, GLuint frame) {
+    MODE_MUST_BE(COMMAND_ANY);
+    if (index < 0 || index >= MAX_QUERY_COUNT) {
+	return;
+    }
+
+    current_command.type = COMMAND_BEGIN_QUERY;
+    current_command.begin_query.index = index;
+    current_command.begin_query.frame = frame;
+
+    ADVANCE_COMMAND();
+}
+
+
+void imEndQuery(void) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_END_QUERY;
+
+    ADVANCE_COMMAND();
+}
+
+
 void imModel(union Matrix4 model) {
     MODE_MUST_BE(COMMAND_ANY);
 
@@ -265,11 +572,17 @@ void imSetLights(void* data) {
 
 void imBegin(GLenum mode) {
     MODE_MUST_BE(COMMAND_ANY);
+    /* Vertices all go straight into the frame, which only the thread
+       recording the frame gets to touch */
+    if (listing) {
+	Warn("Command lists can't hold vertices\n");
+	return;
+    }
     current_mode = COMMAND_PRIMITIVE;
 
     current_command.type = COMMAND_PRIMITIVE;
     current_command.primitive.mode = mode;
-    current_command.primitive.first = vertex_count;
+    current_command.primitive.first = recording->vertex_count;
     current_command.primitive.count = 0;
 }
 
@@ -356,20 +669,55 @@ void imVertex3f(GLfloat x, GLfloat y, GLfloat z) {
     current_vertex.position.y = y;
     current_vertex.position.z = z;
 
-    if (vertex_count < VERTEX_MAX_COUNT) {
+    if (recording->vertex_count < VERTEX_MAX_COUNT) {
         current_command.primitive.count++;
-        vertices[vertex_count++] = current_vertex;
+	recording->vertices[recording->vertex_count++] = current_vertex;
+    } else {
+	dropped_vertices = 1;
     }
 }
 
 
+/* Hands out `count` vertices at once for the caller to fill in, or
+   NULL if the primitive wouldn't fit; unlike imVertex nothing is
+   copied from the current vertex */
+struct Vertex* imReserveVertices(GLsizei count) {
+    MODE_MUST_BE_OR_ERR(COMMAND_PRIMITIVE, NULL);
+
+    if (count < 0 || count > VERTEX_MAX_COUNT - recording->vertex_count) {
+	dropped_vertices = 1;
+	return NULL;
+    }
+
+    struct Vertex* vertices = &recording->vertices[recording->vertex_count];
+    recording->vertex_count += count;
+    current_command.primitive.count += count;
+    return vertices;
+}
+
+
+void imVertices3(GLsizei count, const union Vector3 positions[]) {
+    struct Vertex* vertices = imReserveVertices(count);
+    if (!vertices || count == 0) {
+	return;
+    }
+
+    for (int i=0; i<count; ++i) {
+	vertices[i] = current_vertex;
+	vertices[i].position = positions[i];
+    }
+    current_vertex.position = positions[count - 1];
+}
+
+
+/* The uniform buffer is left bound, so a run of matrix uploads only
+   binds it once */
 static void set_matrix(union Matrix4 matrix, int offset) {
-    glBindBuffer(GL_UNIFORM_BUFFER, MATRICES.id); {
-        glBufferSubData(GL_UNIFORM_BUFFER,
-                        offset * sizeof(union Matrix4),
-                        sizeof(union Matrix4),
-                        &matrix);
-    } glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glsBindBuffer(GL_UNIFORM_BUFFER, MATRICES.id);
+    glBufferSubData(GL_UNIFORM_BUFFER,
+		    offset * sizeof(union Matrix4),
+		    sizeof(union Matrix4),
+		    &matrix);
 }
 
 
@@ -379,7 +727,67 @@ void imFlush(void) {
 }
 
 
-GLuint64 rtLoadMesh(const char * filepath) {
+/* Parses `source` in place */
+static void append_mesh(char * source, union Matrix4 transform) {
+    char * line = source;
+    while (line) {
+	char * endline = strchr(line, '\n');
+	if (endline) {
+	    *endline = '\0';
+
+	    union Vector3 position, normal;
+	    union Vector2 uv;
+
+	    int s = sscanf(line,
+			   "%*i "
+			   "%f,%f,%f "
+			   "%f,%f,%f "
+			   "%f,%f",
+			   &position.x, &position.y, &position.z,
+			   &normal.x, &normal.y, &normal.z,
+			   &uv.u, &uv.v);
+	    if (s == 8) {
+		/* Normals are left unnormalized, same as the lighting
+		   shader leaves them before it normalizes */
+		imNormal3(Transform4(transform, Vector4(normal.x, normal.y, normal.z, 0)).xyz);
+		imTexCoord(uv);
+		imVertex3(Transform4(transform, Vector4(position.x, position.y, position.z, 1)).xyz);
+	    }
+
+	    line = endline + 1;
+	} else {
+	    line = NULL;
+	}
+    }
+}
+
+
+/* The sphere is fit around the box's center, then shrunk to the
+   farthest vertex */
+static struct Bounds3 bound_mesh(GLuint64 mesh) {
+    struct Vertex* vertices = &recording->vertices[mesh >> 32];
+    GLsizei count = (GLsizei)mesh;
+
+    struct Bounds3 bounds = EmptyBounds3();
+    for (int i=0; i<count; ++i) {
+	GrowBounds3(&bounds, vertices[i].position);
+    }
+
+    float radius_squared = 0;
+    for (int i=0; i<count; ++i) {
+	float distance_squared = MagnitudeSquared3(Sub3(vertices[i].position, bounds.center));
+	radius_squared = fmaxf(radius_squared, distance_squared);
+    }
+    bounds.radius = sqrtf(radius_squared);
+
+    return bounds;
+}
+
+
+static THREAD_LOCAL GLint rtBegin_vertex_count;
+
+
+GLuint64 rtLoadMesh(const char * filepath, struct Bounds3 * bounds) {
     char * source = fopenstr(filepath);
 
     if (!source) {
@@ -388,50 +796,62 @@ GLuint64 rtLoadMesh(const char * filepath) {
     }
 
     rtBegin(); {
-	char * line = source;
-	while (line) {
-	    char * endline = strchr(line, '\n');
-	    if (endline) {
-		*endline = '\0';
-
-		union Vector3 position, normal;
-		union Vector2 uv;
-
-		int s = sscanf(line,
-			       "%*i "
-			       "%f,%f,%f "
-			       "%f,%f,%f "
-			       "%f,%f",
-			       &position.x, &position.y, &position.z,
-			       &normal.x, &normal.y, &normal.z,
-			       &uv.u, &uv.v);
-		if (s == 8) {
-		    imNormal3(normal);
-		    imTexCoord(uv);
-		    imVertex3(position);
-		}
-
-		line = endline + 1;
-	    } else {
-		line = NULL;
-	    }
-	}
+	append_mesh(source, Matrix4(1));
     } GLuint64 id = rtEnd();
 
     free(source);
 
+    /* Vertices that don't fit are dropped, so rather than keep what's
+       left of the mesh, take it back out altogether */
+    if (dropped_vertices) {
+	Warn("Ran out of room for vertices loading %s\n", filepath);
+	recording->vertex_count = rtBegin_vertex_count;
+	return 0;
+    }
+
+    if (bounds) {
+	*bounds = bound_mesh(id);
+    }
+
     return id;
 }
 
 
+int rtAppendMesh(const char * filepath, union Matrix4 transform) {
+    MODE_MUST_BE_OR_ERR(COMMAND_PRIMITIVE, SDL_ERR);
+
+    char * source = fopenstr(filepath);
+
+    if (!source) {
+	Warn("Unable to open mesh file. Does %s exist?\n", filepath);
+	return SDL_ERR;
+    }
+
+    /* As with rtLoadMesh, a mesh that doesn't fit is left out
+       altogether rather than appended in part */
+    GLuint vertex_count = recording->vertex_count;
+    dropped_vertices = 0;
+    append_mesh(source, transform);
+    free(source);
+
+    if (dropped_vertices) {
+	Warn("Ran out of room for vertices appending %s\n", filepath);
+	recording->vertex_count = vertex_count;
+	return SDL_ERR;
+    }
+
+    return SDL_OK;
+}
+
+
 GLuint64 rtGenVertexArray(void) {
     GLuint vertex_array, vertex_buffer;
     glGenVertexArrays(1, &vertex_array);
-    glBindVertexArray(vertex_array); {
+    glsBindVertexArray(vertex_array); {
         glGenBuffers(1, &vertex_buffer);
-        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer); {
+	glsBindBuffer(GL_ARRAY_BUFFER, vertex_buffer); {
             glBufferData(GL_ARRAY_BUFFER,
-                         sizeof(vertices),
+			 sizeof(recording->vertices),
                          NULL,
                          GL_DYNAMIC_DRAW);
 
@@ -486,38 +906,36 @@ GLuint64 rtGenVertexArray(void) {
 
 
 void rtBindVertexArray(GLuint64 id) {
-    glBindVertexArray((GLuint)(id >> 32));
-    glBindBuffer(GL_ARRAY_BUFFER, (GLuint)id);
+    MODE_MUST_BE(COMMAND_ANY);
+
+    current_command.type = COMMAND_BIND_VERTEX_ARRAY;
+    current_command.bind_vertex_array.id = id;
+
+    ADVANCE_COMMAND();
 }
 
 
 void rtDeleteVertexArray(GLuint64 id) {
     GLuint vertex_buffer = (GLuint)id;
     GLuint vertex_array = (GLuint)(id >> 32);
-    glDeleteBuffers(1, &vertex_buffer);
-    glDeleteVertexArrays(1, &vertex_array);
+    glsDeleteBuffers(1, &vertex_buffer);
+    glsDeleteVertexArrays(1, &vertex_array);
 }
 
 
-static GLint rtBegin_vertex_count;
-
-
 void rtBegin(void) {
     MODE_MUST_BE(COMMAND_ANY);
     current_mode = COMMAND_PRIMITIVE;
-    rtBegin_vertex_count = vertex_count;
+    rtBegin_vertex_count = recording->vertex_count;
+    dropped_vertices = 0;
 }
 
 
 GLuint64 rtEnd(void) {
-    static GLsizei previous_vertex_count = 0;
-
     MODE_MUST_BE_OR_ERR(COMMAND_PRIMITIVE, 0);
     current_mode = COMMAND_ANY;
 
-    
-    GLsizei vertices_added = vertex_count - previous_vertex_count;
-    previous_vertex_count = vertex_count;
+    GLsizei vertices_added = recording->vertex_count - rtBegin_vertex_count;
     return ((GLuint64)rtBegin_vertex_count << 32) | (GLuint64)vertices_added;
 }
 
@@ -547,58 +965,161 @@ void rtDrawArraysInstanced(GLenum mode, GLuint64 first_count, GLsizei instanceco
 }
 
 
+/* Uploads the vertices recorded since the last fill to the bound
+   vertex array, at the same offsets they were recorded at */
 void rtFillBuffer(void) {
-    glLogErrors();
+    MODE_MUST_BE(COMMAND_ANY);
 
-    glBufferSubData(GL_ARRAY_BUFFER,
-                    0,
-                    vertex_count * sizeof(struct Vertex),
-                    &vertices);
+    current_command.type = COMMAND_FILL_BUFFER;
+    current_command.fill_buffer.first = recording->filled_vertex_count;
+    current_command.fill_buffer.count = recording->vertex_count - recording->filled_vertex_count;
+    recording->filled_vertex_count = recording->vertex_count;
 
-    glLogErrors();
+    ADVANCE_COMMAND();
 }
 
 
-void rtFlush(void) {
-    MODE_MUST_BE(COMMAND_ANY);
+/* Query objects only ever exist on the thread playing commands back.
+   Each result is packed with the frame it was asked for into one
+   atomic, which whatever thread records frames reads. */
+static GLuint queries[MAX_QUERY_COUNT];
+static GLuint query_frames[MAX_QUERY_COUNT];
+static GLuint pending_queries[MAX_QUERY_COUNT];
+static int pending_query_count = 0;
+static u8 query_pending[MAX_QUERY_COUNT];
+static SDL_atomic_t query_results[MAX_QUERY_COUNT];
+
+
+static void begin_query(GLuint index, GLuint frame) {
+    if (!queries[0]) {
+	glGenQueries(MAX_QUERY_COUNT, queries);
+    }
+
+    glBeginQuery(GL_ANY_SAMPLES_PASSED, queries[index]);
+    query_frames[index] = frame;
+    if (!query_pending[index]) {
+	query_pending[index] = 1;
+	pending_queries[pending_query_count++] = index;
+    }
+}
+
 
-    GLuint used_program = -1;
-    GLuint bound_texture = -1;
+/* Never waits on the GPU; whatever isn't ready is checked again the
+   next time */
+static void collect_queries(void) {
+    for (int i=0; i<pending_query_count;) {
+	GLuint index = pending_queries[i];
+	GLuint available;
+	glGetQueryObjectuiv(queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) {
+	    i++;
+	    continue;
+	}
+
+	GLuint passed;
+	glGetQueryObjectuiv(queries[index], GL_QUERY_RESULT, &passed);
+	SDL_AtomicSet(&query_results[index], (int)((query_frames[index] << 1) | (passed ? 1 : 0)));
+
+	query_pending[index] = 0;
+	pending_queries[i] = pending_queries[--pending_query_count];
+    }
+}
 
+
+/* Whether anything passed the last query made with `index` that has
+   come back, or -1 if none has. Frames before the first are 0. */
+int imGetQueryResult(int index, GLuint* frame) {
+    if (index < 0 || index >= MAX_QUERY_COUNT) {
+	return -1;
+    }
+
+    int result = SDL_AtomicGet(&query_results[index]);
+    *frame = (GLuint)result >> 1;
+    return *frame ? result & 1 : -1;
+}
+
+
+static void replay(struct Stream* stream) {
     glLogErrors();
+
+    if (pending_query_count) {
+	collect_queries();
+    }
     
-    GLint i;
-    for (i=0; i<command_count; ++i) {
-        struct Command command = commands[i];
+    const u8* bytes = stream->list.bytes;
+    size_t offset = 0;
+    while (offset < stream->list.size) {
+	struct CommandHeader header;
+	memcpy(&header, bytes + offset, sizeof(header));
+	offset += sizeof(header);
+
+	struct Command command;
+	command.type = header.type;
+	memcpy((u8*)&command + PAYLOAD_OFFSET, bytes + offset, header.size);
+	offset += header.size;
 
         switch (command.type) {
         case COMMAND_ACTIVE_TEXTURE:
-            glActiveTexture(command.active_texture.texture);
+	    glsActiveTexture(command.active_texture.texture);
             glLogErrors();
 	    break;
         case COMMAND_ANY:
+	case COMMAND_TYPE_COUNT:
             break;
+	case COMMAND_BEGIN_QUERY:
+	    begin_query(command.begin_query.index, command.begin_query.frame);
+	    break;
+	case COMMAND_BIND_FRAMEBUFFER:
+	    glsBindFramebuffer(GL_FRAMEBUFFER, command.bind_framebuffer.id);
+	    break;
         case COMMAND_BIND_TEXTURE:
-	    if (bound_texture != command.bind_texture.id) {
-		bound_texture = command.bind_texture.id;
-		glBindTexture(command.bind_texture.target, command.bind_texture.id);
-	    }
+	    glsBindTexture(command.bind_texture.target, command.bind_texture.id);
 	    glLogErrors();
             break;
+	case COMMAND_BIND_VERTEX_ARRAY:
+	    glsBindVertexArray((GLuint)(command.bind_vertex_array.id >> 32));
+	    glsBindBuffer(GL_ARRAY_BUFFER, (GLuint)command.bind_vertex_array.id);
+	    break;
 	case COMMAND_CLEAR:
 	    glClear(command.clear.mask);
 	    break;
+	case COMMAND_COLOR_MASK:
+	    glsColorMask(command.color_mask.r, command.color_mask.g,
+			 command.color_mask.b, command.color_mask.a);
+	    break;
+	case COMMAND_DEPTH_FUNC:
+	    glsDepthFunc(command.depth_func.func);
+	    break;
+	case COMMAND_DEPTH_MASK:
+	    glsDepthMask(command.depth_mask.flag);
+	    break;
+	case COMMAND_DISABLE:
+	    glsDisable(command.capability.cap);
+	    break;
 	case COMMAND_DRAW_COLOR:
-	    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-	    glDepthMask(GL_TRUE);
-	    glStencilFunc(GL_EQUAL, 1, 0xFF);
-	    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+	    glsColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	    glsDepthMask(GL_TRUE);
+	    glsStencilFunc(GL_EQUAL, 1, 0xFF);
+	    glsStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
 	    break;
 	case COMMAND_DRAW_STENCIL:
-	    glColorMask(GL_FALSE,GL_FALSE, GL_FALSE, GL_FALSE);
-	    glDepthMask(GL_FALSE);
-	    glStencilFunc(GL_ALWAYS, 1, 0xFF);
-	    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+	    glsColorMask(GL_FALSE,GL_FALSE, GL_FALSE, GL_FALSE);
+	    glsDepthMask(GL_FALSE);
+	    glsStencilFunc(GL_ALWAYS, 1, 0xFF);
+	    glsStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+	    break;
+	case COMMAND_ENABLE:
+	    glsEnable(command.capability.cap);
+	    break;
+	case COMMAND_END_QUERY:
+	    glEndQuery(GL_ANY_SAMPLES_PASSED);
+	    break;
+	case COMMAND_FILL_BUFFER:
+	    glBufferSubData(GL_ARRAY_BUFFER,
+			    command.fill_buffer.first * sizeof(struct Vertex),
+			    command.fill_buffer.count * sizeof(struct Vertex),
+			    &stream->vertices[command.fill_buffer.first]);
+	    glLogErrors();
 	    break;
         case COMMAND_INSTANCED_PRIMITIVE:
             glLogErrors();
@@ -621,10 +1142,7 @@ void rtFlush(void) {
             glLogErrors();
             break;
         case COMMAND_PROGRAM:
-	    if (used_program != command.program.id) {
-		used_program = command.program.id;
-		glUseProgram(command.program.id);
-	    }
+	    glsUseProgram(command.program.id);
 	    glLogErrors();
             break;
         case COMMAND_PROJECTION:
@@ -632,28 +1150,264 @@ void rtFlush(void) {
             glLogErrors();
             break;
 	case COMMAND_SET_LIGHTS:
-	    glBindBuffer(GL_UNIFORM_BUFFER, LIGHTS.id); {
-		glBufferSubData(GL_UNIFORM_BUFFER,
-				0,
-				LIGHTS.size,
-				command.set_lights.data);
-	    } glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	    glsBindBuffer(GL_UNIFORM_BUFFER, LIGHTS.id);
+	    glBufferSubData(GL_UNIFORM_BUFFER,
+			    0,
+			    LIGHTS.size,
+			    command.set_lights.data);
+	    break;
+	case COMMAND_STENCIL_FUNC:
+	    glsStencilFunc(command.stencil_func.func,
+			   command.stencil_func.ref,
+			   command.stencil_func.mask);
+	    break;
+	case COMMAND_STENCIL_OP:
+	    glsStencilOp(command.stencil_op.sfail,
+			 command.stencil_op.dpfail,
+			 command.stencil_op.dppass);
 	    break;
         case COMMAND_VIEW:
             set_matrix(command.view, 1);
             glLogErrors();
             break;
+	case COMMAND_VIEWPORT:
+	    glsViewport(command.viewport.x, command.viewport.y,
+			command.viewport.width, command.viewport.height);
+	    break;
         }
     }
 
     glLogErrors();
-    
-    command_count = 0;
-    vertex_count = 0;
+}
+
+
+static void reset(struct Stream* stream) {
+    stream->list.size = 0;
+    stream->vertex_count = 0;
+    stream->filled_vertex_count = 0;
     /* TODO It might be worth resetting the current vertex to a blank state */
 }
 
 
+/* Once the render thread is running it owns the GL context, and the
+   thread recording a frame never touches GL itself. Frames are handed
+   back and forth through a pair of semaphores, which act as fences:
+   one says a stream is ready to be played back, the other says a
+   stream has been played back and can be recorded into again. */
+static SDL_Thread* render_thread = NULL;
+static SDL_sem* recorded_fence;
+static SDL_sem* replayed_fence;
+static SDL_atomic_t render_thread_stopping;
+static SDL_Window* render_window;
+static SDL_GLContext render_context;
+
+
+/* The render thread hands these over along with the stream it played
+   back, so there's one for each stream, and the fences order the
+   accesses. By the time one's read, the render thread may well have
+   moved on to playing back the other stream. */
+static struct GLStateCounters replayed_counters[2];
+static struct GLStateCounters presented_counters;
+static double replayed_times[2];
+static double presented_time;
+
+
+/* Each stream's playback is timed on the GPU too. A stream's timer is
+   read back the next time the stream comes round, by when the fence
+   has made sure it's done, so GPU times arrive a few frames late. The
+   last few are kept, tagged with the frame they're for, counting from
+   when the render thread started. */
+#define GPU_TIME_HISTORY 8
+
+static GLuint gpu_timers[2];
+static u64 gpu_timer_frames[2];
+static int gpu_timer_started[2];
+static SDL_mutex* gpu_time_lock;
+static struct {
+    u64 frame;
+    double time;
+} gpu_times[GPU_TIME_HISTORY];
+
+
+static int render(void* data) {
+    SDL_GL_MakeCurrent(render_window, render_context);
+
+    /* Keep the GPU from falling more than a frame behind us */
+    GLsync gpu_fence = 0;
+
+    glGenQueries(2, gpu_timers);
+
+    for (u64 frame=0, stream_index=0;; frame++, stream_index^=1) {
+	SDL_SemWait(recorded_fence);
+	if (SDL_AtomicGet(&render_thread_stopping)) {
+	    break;
+	}
+
+	if (gpu_fence) {
+	    glClientWaitSync(gpu_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+	    glDeleteSync(gpu_fence);
+	}
+
+	if (gpu_timer_started[stream_index]) {
+	    GLuint64 elapsed;
+	    glGetQueryObjectui64v(gpu_timers[stream_index], GL_QUERY_RESULT, &elapsed);
+	    u64 timed_frame = gpu_timer_frames[stream_index];
+	    SDL_LockMutex(gpu_time_lock);
+	    gpu_times[timed_frame % GPU_TIME_HISTORY].frame = timed_frame;
+	    gpu_times[timed_frame % GPU_TIME_HISTORY].time = elapsed / 1e9;
+	    SDL_UnlockMutex(gpu_time_lock);
+	}
+
+	double replay_start_time = GetPerformanceTime();
+	glBeginQuery(GL_TIME_ELAPSED, gpu_timers[stream_index]);
+	replay(&streams[stream_index]);
+	glEndQuery(GL_TIME_ELAPSED);
+	gpu_timer_frames[stream_index] = frame;
+	gpu_timer_started[stream_index] = 1;
+	replayed_times[stream_index] = GetPerformanceTime() - replay_start_time;
+	SDL_GL_SwapWindow(render_window);
+	gpu_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	replayed_counters[stream_index] = glsTakeCounters();
+
+	SDL_SemPost(replayed_fence);
+    }
+
+    if (gpu_fence) {
+	glDeleteSync(gpu_fence);
+    }
+    glDeleteQueries(2, gpu_timers);
+    SDL_GL_MakeCurrent(render_window, NULL);
+
+    return 0;
+}
+
+
+int rtStartRenderThread(SDL_Window* window, SDL_GLContext context) {
+    recorded_fence = SDL_CreateSemaphore(0);
+    replayed_fence = SDL_CreateSemaphore(1);
+    gpu_time_lock = SDL_CreateMutex();
+    for (int i=0; i<GPU_TIME_HISTORY; i++) {
+	gpu_times[i].frame = U64_MAX;
+    }
+    gpu_timer_started[0] = gpu_timer_started[1] = 0;
+    if (!recorded_fence || !replayed_fence || !gpu_time_lock) {
+	Err("Unable to create render fences because %s\n", SDL_GetError());
+	return SDL_ERR;
+    }
+
+    /* Anything recorded before now has already been played back, or
+       it's stuff like meshes that have been uploaded already */
+    reset(&streams[0]);
+    reset(&streams[1]);
+    recording = &streams[0];
+    memset(replayed_counters, 0, sizeof(replayed_counters));
+    memset(replayed_times, 0, sizeof(replayed_times));
+
+    render_window = window;
+    render_context = context;
+    SDL_AtomicSet(&render_thread_stopping, 0);
+    SDL_GL_MakeCurrent(window, NULL);
+
+    render_thread = SDL_CreateThread(render, "render", NULL);
+    if (!render_thread) {
+	Err("Unable to create the render thread because %s\n", SDL_GetError());
+	SDL_GL_MakeCurrent(window, context);
+	return SDL_ERR;
+    }
+
+    return SDL_OK;
+}
+
+
+void rtStopRenderThread(void) {
+    if (!render_thread) {
+	return;
+    }
+
+    SDL_AtomicSet(&render_thread_stopping, 1);
+    SDL_SemPost(recorded_fence);
+    SDL_WaitThread(render_thread, NULL);
+    render_thread = NULL;
+
+    SDL_DestroySemaphore(recorded_fence);
+    SDL_DestroySemaphore(replayed_fence);
+    SDL_DestroyMutex(gpu_time_lock);
+
+    SDL_GL_MakeCurrent(render_window, render_context);
+}
+
+
+/* Hands the frame we've recorded to the render thread, and starts on
+   the next one as soon as the render thread is done with the stream
+   we'll be recording it into */
+void rtPresent(void) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    if (!render_thread) {
+	rtFlush();
+	presented_counters = glsTakeCounters();
+	presented_time = 0;
+	return;
+    }
+
+    /* The fence we get back is for the stream recorded before this one */
+    int replayed_index = (recording == &streams[0]) ? 1 : 0;
+    SDL_SemPost(recorded_fence);
+    SDL_SemWait(replayed_fence);
+    presented_counters = replayed_counters[replayed_index];
+    presented_time = replayed_times[replayed_index];
+
+    recording = (recording == &streams[0]) ? &streams[1] : &streams[0];
+    reset(recording);
+}
+
+
+/* What the last presented frame actually asked of GL */
+struct GLStateCounters rtGetFrameCounters(void) {
+    return presented_counters;
+}
+
+
+/* How long the render thread spent playing back the last presented
+   frame, leaving out waiting on the GPU and vsync. Without a render
+   thread, frames are played back as they're recorded, so it's 0. */
+double rtGetFrameReplayTime(void) {
+    return presented_time;
+}
+
+
+/* How long the GPU took over a frame, counting frames presented since
+   the render thread started. It's -1 until the time is known, once it's
+   too old to be kept, or without a render thread. */
+double rtGetFrameGPUTime(u64 frame) {
+    if (!render_thread) {
+	return -1;
+    }
+
+    SDL_LockMutex(gpu_time_lock);
+    double time = -1;
+    if (gpu_times[frame % GPU_TIME_HISTORY].frame == frame) {
+	time = gpu_times[frame % GPU_TIME_HISTORY].time;
+    }
+    SDL_UnlockMutex(gpu_time_lock);
+    return time;
+}
+
+
+void rtFlush(void) {
+    MODE_MUST_BE(COMMAND_ANY);
+
+    /* The render thread plays back whole frames by itself, and command
+       lists get played back with whatever they're appended to */
+    if (render_thread || listing) {
+	return;
+    }
+
+    replay(recording);
+    reset(recording);
+}
+
+
 GLuint LoadShader(GLenum type, const char * filepath) {
     char * source = fopenstr(filepath);
     
@@ -708,8 +1462,8 @@ GLuint LoadTexture(const char* filepath) {
     GLuint id;
     glGenTextures(1, &id);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, id);
+    glsActiveTexture(GL_TEXTURE0);
+    glsBindTexture(GL_TEXTURE_2D, id);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
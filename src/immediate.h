@@ -5,6 +5,14 @@
 #include "mathematics.h"
 
 
+struct Vertex {
+    union Vector3 position;
+    union Vector3 normal;
+    union Vector4 color;
+    union Vector2 texcoord;
+};
+
+
 /* TODO Delete this? */
 extern const struct UniformBuffer MATRIX_BUFFER;
 
@@ -16,13 +24,40 @@ void imInitInternalVertexArray(void);
 void imBindVertexArray(void);
 
 
+#define MAX_COMMAND_LIST_COUNT 16
+
+
+void imBeginCommandList(int index);
+void imEndCommandList(void);
+void imAppendCommandList(int index);
+
+
+void imBindFramebuffer(GLuint framebuffer);
+void imViewport(GLint x, GLint y, GLsizei width, GLsizei height);
 void imClear(GLbitfield mask);
 
 
+void imEnable(GLenum cap);
+void imDisable(GLenum cap);
+void imColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a);
+void imDepthMask(GLboolean flag);
+void imDepthFunc(GLenum func);
+void imStencilFunc(GLenum func, GLint ref, GLuint mask);
+void imStencilOp(GLenum sfail, GLenum dpfail, GLenum dppass);
+
+
 void imDrawColor(void);
 void imDrawStencil(void);
 
 
+#define MAX_QUERY_COUNT 1024
+
+
+void imBeginQuery(int index, GLuint frame);
+void imEndQuery(void);
+int imGetQueryResult(int index, GLuint* frame);
+
+
 void imModel(union Matrix4 model);
 void imView(union Matrix4 view);
 void imProjection(union Matrix4 projection);
@@ -60,6 +95,10 @@ void imVertex3(union Vector3 position);
 void imVertex3f(GLfloat x, GLfloat y, GLfloat z);
 
 
+struct Vertex* imReserveVertices(GLsizei count);
+void imVertices3(GLsizei count, const union Vector3 positions[]);
+
+
 void imFlush(void);
 
 
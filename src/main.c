@@ -6,11 +6,14 @@
 #include "immediate.h"
 #include "ladder.h"
 #include "logger.h"
-/* #include "navigation.h" */
+#include "navigation.h"
 #include "player.h"
+#include "random.h"
 #include "retained.h"
 #include "SDL_plus.h"
+#include "simulation.h"
 #include "stdlib_plus.h"
+#include "workers.h"
 
 #define TITLE "Kowloon_Simulator_2020 v0.1.0"
 
@@ -23,7 +26,27 @@
 #define DEFAULT_WINDOW_WIDTH 1280
 #define DEFAULT_WINDOW_HEIGHT 720
 
+/* How many portals deep to render. The depth adapts to how long
+   frames take, within these bounds, and the world is only grown as
+   far ahead as it's being drawn, since there are only so many
+   instances to go round. */
+#define MIN_RECURSION_DEPTH 1
+#define INITIAL_RECURSION_DEPTH 2
+#define MAX_RECURSION_DEPTH 4
+
+/* Portals smaller than this many pixels aren't drawn through */
+#define MIN_PORTAL_PIXELS 16.0f
+#define FAR_PLANE 100.0f
+
+/* Headless runs draw into an offscreen window, which SDL backs with
+   an EGL pbuffer, so they don't need a display */
+static int headless = 0;
+
 static enum Continue init_sdl(void) {
+    if (headless) {
+	SDL_setenv("SDL_VIDEODRIVER", "offscreen", 1);
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) != SDL_OK) {
 	Err("Unable to initialize SDL because %s\n", SDL_GetError());
 	return DOWN;
@@ -47,6 +70,11 @@ static enum Continue set_gl_attributes(void) {
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
     SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
 
+#ifdef DEBUG
+    /* Lets errors be reported by callback instead of polled for */
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG);
+#endif
+
     return UP;
 }
 
@@ -77,8 +105,10 @@ static enum Continue open_window(void) {
 	return DOWN;
     }
 
-    SDL_SetRelativeMouseMode(SDL_TRUE);
-    SDL_ShowCursor(SDL_DISABLE);
+    if (!headless) {
+	SDL_SetRelativeMouseMode(SDL_TRUE);
+	SDL_ShowCursor(SDL_DISABLE);
+    }
 
     return UP;
 }
@@ -101,6 +131,13 @@ static enum Continue create_gl_context(void) {
     }
 
     GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    /* GLEW built for GLX still loads everything for an EGL context,
+       it just can't find an X display to go with it */
+    if (headless && err == GLEW_ERROR_NO_GLX_DISPLAY) {
+	err = GLEW_OK;
+    }
+#endif
     if (GLEW_OK != err) {
       Err("Unable to initialize GLEW because %s\n", glewGetErrorString(err));
       return DOWN;
@@ -108,12 +145,19 @@ static enum Continue create_gl_context(void) {
 
     int swap = SDL_GL_SetSwapInterval(1);
 
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
-    glCullFace(GL_BACK);
-    glFrontFace(GL_CCW);
+#ifdef DEBUG
+    if (!glEnableDebugOutput()) {
+	Log("KHR_debug is unavailable, so OpenGL errors will be polled for\n");
+    }
+#endif
+
+    glsInvalidate();
+    glsEnable(GL_DEPTH_TEST);
+    glsEnable(GL_CULL_FACE);
+    glsCullFace(GL_BACK);
+    glsFrontFace(GL_CCW);
 
-    glClearColor(0, 0, 0, 1);
+    glsClearColor(0, 0, 0, 1);
 
     glLogErrors();
 
@@ -149,6 +193,7 @@ static enum Continue create_renderer(void) {
        by 270, so we can create a framebuffer of that size and
        modulate the viewport size */
     internal_framebuffer = CreateFramebuffer(MAX_INTERNAL_WIDTH, MAX_INTERNAL_HEIGHT);
+    SetPortalCutoff(INTERNAL_RESOLUTION.x, INTERNAL_RESOLUTION.y, MIN_PORTAL_PIXELS, FAR_PLANE);
     internal_framebuffer_program = LoadProgram(FromBase("assets/shaders/world_space.vert"),
 					       FromBase("assets/shaders/textured.frag"));
     
@@ -158,6 +203,15 @@ static enum Continue create_renderer(void) {
     return UP;
 }
 
+/* Only the deepest level is drawn as impostors, since it's the one
+   with the least on screen, and only once there's more than one */
+static int use_impostors = 0;
+
+static enum Continue create_impostors(void) {
+    CreateImpostors(1, internal_framebuffer.buffer, INTERNAL_RESOLUTION.x, INTERNAL_RESOLUTION.y);
+    return UP;
+}
+
 static char* area_to_load;
 
 static enum Continue load_area(void) {
@@ -167,10 +221,11 @@ static enum Continue load_area(void) {
 
     rtBindVertexArray(SCENERY_VERTEX_ARRAY);
     Area area = LoadArea(area_to_load);
+    rtLoadMeshLods();
     rtFillBuffer();
+    rtFlush();
 
-    InstanceArea(area);
-    LinkInstancedNetworks();
+    GrowWorld(InstanceArea(area), INITIAL_RECURSION_DEPTH);
 
     return UP;
 }
@@ -207,129 +262,402 @@ static enum Continue load_areas_from_index(void) {
     
     free(source);
 
+    rtLoadMeshLods();
     rtFillBuffer();
+    rtFlush();
 
-    InstanceAreas(MAX_INSTANCED_AREA_COUNT);
-    LinkInstancedNetworks();
+    GrowWorld(InstanceArea(GetArea(0)), INITIAL_RECURSION_DEPTH);
 
     return UP;
 }
 
-static enum Continue loop(void) {
-    GLuint atlas_texture = LoadTexture(FromBase("assets/textures/atlas.png"));
+static GLuint atlas_texture;
+
+static enum Continue load_textures(void) {
+    atlas_texture = LoadTexture(FromBase("assets/textures/atlas.png"));
 
+    return UP;
+}
+
+/* From here on, the render thread owns the GL context. This thread
+   only ever records what to draw. */
+static enum Continue start_render_thread(void) {
+    if (rtStartRenderThread(window, context) != SDL_OK) {
+	return DOWN;
+    }
+
+    return UP;
+}
+
+static void stop_render_thread(void) {
+    rtStopRenderThread();
+}
+
+static enum Continue spawn_player(void) {
     SpawnPlayer(GetAreaInstance(0));
-    
+    SetSimulationDepth(INITIAL_RECURSION_DEPTH);
+
+    return UP;
+}
+
+/* Frames are timed on both threads, leaving out waiting on each other
+   and on vsync, and whichever took longer is what counts against the
+   budget. The recursion backs off as soon as frames run over, and
+   only goes deeper once they've been comfortably under for a while,
+   since each level can cost several times the one before it. */
+static double frame_budget = 1.0 / 60.0;
+
+#define FRAME_TIME_SMOOTHING 0.1
+#define DEEPER_FRACTION 0.5
+#define DEEPER_FRAME_COUNT 60
+#define SHALLOWER_FRAME_COUNT 15
+
+static int adapt_recursion_depth(int depth, double frame_time) {
+    static double smoothed_time = 0;
+    static int settled_frame_count = 0;
+
+    smoothed_time += (frame_time - smoothed_time) * FRAME_TIME_SMOOTHING;
+    settled_frame_count++;
+
+    if (smoothed_time > frame_budget
+	&& depth > MIN_RECURSION_DEPTH
+	&& settled_frame_count >= SHALLOWER_FRAME_COUNT) {
+	settled_frame_count = 0;
+	return depth - 1;
+    }
+    if (smoothed_time < frame_budget * DEEPER_FRACTION
+	&& depth < MAX_RECURSION_DEPTH
+	&& settled_frame_count >= DEEPER_FRAME_COUNT) {
+	settled_frame_count = 0;
+	return depth + 1;
+    }
+    return depth;
+}
+
+/* Draws the scene through portals `depth` deep into the internal
+   framebuffer, then scales that up to fill the window */
+static void draw_frame(struct Viewpoint viewpoint, int depth) {
+    /* Draw to internal framebuffer */
+    {
+	imBindFramebuffer(internal_framebuffer.buffer);
+	imViewport(0, 0, INTERNAL_RESOLUTION.x, INTERNAL_RESOLUTION.y);
+
+	imClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	union Matrix4 projection = Perspective(100, internal_aspect_ratio(), 0.1, FAR_PLANE);
+	imProjection(projection);
+
+	/* Draw the area */
+	imModel(Matrix4(1));
+
+	imBindTexture(GL_TEXTURE_2D, atlas_texture);
+
+	{
+	    /* glEnable(GL_STENCIL_TEST); */
+	    /* rtBindVertexArray(SCENERY_VERTEX_ARRAY); */
+	    DrawSceneryRecursively(viewpoint.area, -1, viewpoint.cell_index, projection,
+				   GetViewpointView(viewpoint), depth);
+	    /* rtFlush(); */
+	    /* glDisable(GL_STENCIL_TEST); */
+	}
+    }
+
+    /* Draw to the window's default framebuffer */
+    {
+	imBindFramebuffer(0);
+	imViewport(0, 0, RESOLUTION.x, RESOLUTION.y);
+
+	imClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	imModel(Matrix4(1));
+	imView(Matrix4(1));
+	imProjection(Orthographic(0, INTERNAL_RESOLUTION.x,
+				  0, INTERNAL_RESOLUTION.y,
+				  -1, 1));
+
+	imUseProgram(internal_framebuffer_program);
+	imBindTexture(GL_TEXTURE_2D, internal_framebuffer.color);
+
+	/* Fill the screen with a single quad */
+	imBindVertexArray();
+	imBegin(GL_TRIANGLE_STRIP); {
+	    imColor3ub(0, 0, 0);
+	    imTexCoord2f(0, 0);
+	    imVertex2f(0, 0);
+
+	    imColor3ub(255, 0, 0);
+	    imTexCoord2f(1, 0);
+	    imVertex2f(internal_framebuffer.resolution.x, 0);
+
+	    imColor3ub(0, 255, 0);
+	    imTexCoord2f(0, 1);
+	    imVertex2f(0, internal_framebuffer.resolution.y);
+
+	    imColor3ub(255, 255, 0);
+	    imTexCoord2f(1, 1);
+	    imVertex2f(internal_framebuffer.resolution.x,
+		       internal_framebuffer.resolution.y);
+	} imEnd();
+	imFlush();
+    }
+}
+
+/* Two snapshots, kept between frames so we don't copy them onto the
+   stack every frame */
+static struct Snapshot previous_snapshot, current_snapshot;
+
+static enum Continue loop(void) {
     /* Initialize matrices */
     imModel(Matrix4(1));
     imView(Matrix4(1));
     imProjection(Orthographic(0, RESOLUTION.x, 0, RESOLUTION.y, -1, 1));
 
-    double delta_time = 1.0 / 30.0; /* TODO Replace with a constant */
-
-    double time = 0.0;
-    double accumulator = 0.0;
-
-    double current_time = GetPerformanceTime();
-    double initial_time = current_time;
+    u64 frame_count = 0;
+    u64 change_count = 0, bind_count = 0, skipped_count = 0;
+    u64 occluded_count = 0;
+    u64 depth_sum = 0;
+    int recursion_depth = INITIAL_RECURSION_DEPTH;
 
     while (!HasQuit()) {
-	double new_time = GetPerformanceTime();
-	double frame_time = new_time - current_time;
-	if (frame_time > 0.25) {
-	    frame_time = 0.25;
+	double record_start_time = GetPerformanceTime();
+
+	/* The simulation runs on its own thread, so all that's left
+	   to do here is hand it our input and draw what it's done */
+	PollEvents();
+
+	ReadSnapshots(&previous_snapshot, &current_snapshot);
+	float alpha = GetSnapshotAlpha(&current_snapshot);
+	struct Viewpoint viewpoint = LerpViewpoint(previous_snapshot.player,
+						   current_snapshot.player,
+						   alpha);
+	DrawWithLinkTable(&current_snapshot.links);
+	draw_frame(viewpoint, recursion_depth);
+
+	double record_time = GetPerformanceTime() - record_start_time;
+	rtPresent();
+
+	depth_sum += recursion_depth;
+	int adapted_depth = adapt_recursion_depth(recursion_depth, fmax(record_time, rtGetFrameReplayTime()));
+	if (adapted_depth != recursion_depth) {
+	    recursion_depth = adapted_depth;
+	    SetSimulationDepth(recursion_depth);
 	}
-	current_time = new_time;
-	accumulator += frame_time;
 
-	while (accumulator >= delta_time) {
-	    /* Call fixed update functions */
-	    PollEvents();
-	    /* walkabout(delta_time); */
-	    PlayerWalkabout(delta_time);
+	struct GLStateCounters counters = rtGetFrameCounters();
+	change_count += counters.changes;
+	bind_count += counters.binds;
+	skipped_count += counters.skipped;
+	occluded_count += GetOccludedSubtreeCount();
+	frame_count++;
+    }
 
-	    time += delta_time;
-	    accumulator -= delta_time;
-	}
+    if (frame_count > 0) {
+	Log("Over %llu frames, each frame averaged %f state changes and %f binds, "
+	    "and skipped %f redundant ones\n",
+	    (unsigned long long)frame_count,
+	    (double)change_count / frame_count,
+	    (double)bind_count / frame_count,
+	    (double)skipped_count / frame_count);
+	Log("Each frame skipped %f subtrees hidden behind scenery\n",
+	    (double)occluded_count / frame_count);
+	Log("Portals were drawn %f deep on average\n",
+	    (double)depth_sum / frame_count);
+    }
+    
+    return UP;
+}   
+
+/* Headless runs fly a scripted camera through the portal graph for a
+   set number of frames and write out how long each one took. The
+   simulation is stepped in lockstep, one tick per frame, and the depth
+   is held where it starts so runs can be compared with each other. */
+static int benchmark_frame_count;
+static char* benchmark_csv_path = "frames.csv";
+
+/* Headless runs are seeded the same way every time unless told
+   otherwise, so that two of them differ only in what's being measured */
+#define DEFAULT_BENCHMARK_SEED 1
+static int seed = DEFAULT_BENCHMARK_SEED;
+
+struct FrameTiming {
+    double record_time, replay_time, gpu_time;
+    u64 changes, binds, occluded;
+};
+
+static struct LinkTable benchmark_links;
+
+static enum Continue benchmark_frames(void) {
+    struct FrameTiming* timings = calloc(benchmark_frame_count, sizeof(*timings));
+    if (!timings) {
+	Err("Unable to allocate timings for %d frames\n", benchmark_frame_count);
+	return DOWN;
+    }
+    for (int frame=0; frame<benchmark_frame_count; frame++) {
+	timings[frame].gpu_time = -1;
+    }
+
+    imModel(Matrix4(1));
+    imView(Matrix4(1));
+    imProjection(Orthographic(0, RESOLUTION.x, 0, RESOLUTION.y, -1, 1));
 
-	double alpha = accumulator / delta_time;
+    struct Random* random = GetStream(RANDOM_MISCELLANEOUS);
+    const int depth = INITIAL_RECURSION_DEPTH;
 
-	/* Call update functions */
-	Area area = GetPlayerArea();
-	
-	/* Draw to internal framebuffer */
-	{
-	    glBindFramebuffer(GL_FRAMEBUFFER, internal_framebuffer.buffer);
-	    glViewport(0, 0, INTERNAL_RESOLUTION.x, INTERNAL_RESOLUTION.y);
-	
-	    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    /* The render thread is a frame behind, and GPU times come in a few
+       frames after that, so it takes a few empty frames at the end to
+       get everything back */
+    const int drain_frame_count = 3;
 
-	    imProjection(Perspective(100, internal_aspect_ratio(), 0.1, 100.0));
+    double start_time = GetPerformanceTime();
+    for (int frame=0; frame<benchmark_frame_count + drain_frame_count; frame++) {
+	if (frame < benchmark_frame_count) {
+	    double record_start_time = GetPerformanceTime();
 
-	    /* Draw the area */
-	    imModel(Matrix4(1));
+	    PlayerFlythrough(TICK_DURATION, random);
+	    StepAgents(TICK_DURATION);
+	    GrowWorld(GetPlayerArea(), depth);
 
-	    imBindTexture(GL_TEXTURE_2D, atlas_texture);
+	    CopyLinkTable(&benchmark_links);
+	    DrawWithLinkTable(&benchmark_links);
+	    draw_frame(GetPlayerViewpoint(), depth);
 
-	    {
-		/* glEnable(GL_STENCIL_TEST); */
-		/* rtBindVertexArray(SCENERY_VERTEX_ARRAY); */
-		DrawSceneryRecursively(area, -1, GetPlayerView(), 2);
-		/* rtFlush(); */
-		/* glDisable(GL_STENCIL_TEST); */
-	    }	    
+	    timings[frame].record_time = GetPerformanceTime() - record_start_time;
+	    timings[frame].occluded = GetOccludedSubtreeCount();
+	}
+	rtPresent();
+
+	/* What's handed back is for the frame before this one */
+	if (frame > 0 && frame <= benchmark_frame_count) {
+	    struct GLStateCounters counters = rtGetFrameCounters();
+	    timings[frame - 1].replay_time = rtGetFrameReplayTime();
+	    timings[frame - 1].changes = counters.changes;
+	    timings[frame - 1].binds = counters.binds;
 	}
 
-	/* Draw to the window's default framebuffer */
-	{
-	    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	    glViewport(0, 0, RESOLUTION.x, RESOLUTION.y);
-
-	    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	    imModel(Matrix4(1));
-	    imView(Matrix4(1));
-	    imProjection(Orthographic(0, INTERNAL_RESOLUTION.x,
-				      0, INTERNAL_RESOLUTION.y,
-				      -1, 1));
-
-	    imUseProgram(internal_framebuffer_program);
-	    imBindTexture(GL_TEXTURE_2D, internal_framebuffer.color);
-
-	    /* Fill the screen with a single quad */
-	    imBindVertexArray();
-	    imBegin(GL_TRIANGLE_STRIP); {
-		imColor3ub(0, 0, 0);
-		imTexCoord2f(0, 0);
-		imVertex2f(0, 0);
-
-		imColor3ub(255, 0, 0);
-		imTexCoord2f(1, 0);
-		imVertex2f(internal_framebuffer.resolution.x, 0);
-
-		imColor3ub(0, 255, 0);
-		imTexCoord2f(0, 1);
-		imVertex2f(0, internal_framebuffer.resolution.y);
-
-		imColor3ub(255, 255, 0);
-		imTexCoord2f(1, 1);
-		imVertex2f(internal_framebuffer.resolution.x,
-			   internal_framebuffer.resolution.y);
-	    } imEnd();
-	    imFlush();
+	int oldest_frame = (frame > drain_frame_count) ? frame - drain_frame_count : 0;
+	for (int timed_frame=oldest_frame; timed_frame<=frame && timed_frame<benchmark_frame_count; timed_frame++) {
+	    if (timings[timed_frame].gpu_time < 0) {
+		timings[timed_frame].gpu_time = rtGetFrameGPUTime(timed_frame);
+	    }
 	}
-	
-	glLogErrors();
+    }
+    double elapsed_time = GetPerformanceTime() - start_time;
 
-	SDL_GL_SwapWindow(window);
+    FILE* csv = fopen(benchmark_csv_path, "w");
+    if (!csv) {
+	Err("Unable to open %s to write frame timings to\n", benchmark_csv_path);
+	free(timings);
+	return DOWN;
     }
-    
+    fprintf(csv, "# seed=%d\n", seed);
+    fprintf(csv, "frame,depth,record_ms,replay_ms,gpu_ms,state_changes,binds,occluded_subtrees\n");
+    for (int frame=0; frame<benchmark_frame_count; frame++) {
+	struct FrameTiming* timing = &timings[frame];
+	fprintf(csv, "%d,%d,%f,%f,%f,%llu,%llu,%llu\n",
+		frame, depth,
+		timing->record_time * 1000.0,
+		timing->replay_time * 1000.0,
+		timing->gpu_time < 0 ? -1.0 : timing->gpu_time * 1000.0,
+		(unsigned long long)timing->changes,
+		(unsigned long long)timing->binds,
+		(unsigned long long)timing->occluded);
+    }
+    fclose(csv);
+    free(timings);
+
+    Log("Drew %d frames %d deep in %f seconds, and wrote their timings to %s\n",
+	benchmark_frame_count, depth, elapsed_time, benchmark_csv_path);
+
     return UP;
-}   
+}
+
+/* The first instance and every instance linked to it, which is as
+   far as the world has grown when nobody's walked around it yet */
+static int get_benchmark_areas(Area areas[MAX_PORTAL_COUNT + 1]) {
+    Area around = GetAreaInstance(0);
+    int area_count = 0;
+    areas[area_count++] = around;
+    for (int portal_index=0; portal_index<GetPortalCount(around); portal_index++) {
+	Area destination;
+	int destination_portal_index;
+	if (GetPortalLink(around, portal_index, &destination, &destination_portal_index)) {
+	    areas[area_count++] = destination;
+	}
+    }
+    return area_count;
+}
+
+static int benchmark_agent_count;
+
+/* Steps a crowd of agents wandering between the instances around the
+   first one, finding their way with paths, without drawing anything,
+   and reports the tick rate */
+static enum Continue benchmark_agents(void) {
+    Area areas[MAX_PORTAL_COUNT + 1];
+    int area_count = get_benchmark_areas(areas);
+
+    for (int i=0; i<benchmark_agent_count; i++) {
+	Agent agent = SpawnAgent(areas[i % area_count]);
+	if (agent == INVALID_AGENT) {
+	    break;
+	}
+	SetAgentWandering(agent, 1.0f);
+    }
+
+    const int tick_count = 300;
+
+    double start_time = GetPerformanceTime();
+    for (int tick=0; tick<tick_count; tick++) {
+	StepAgents(TICK_DURATION);
+    }
+    double elapsed_time = GetPerformanceTime() - start_time;
+
+    Log("Stepped %d agents %d times in %f seconds, which is %f ticks per second\n",
+	GetAgentCount(), tick_count, elapsed_time, tick_count / elapsed_time);
+
+    return UP;
+}
+
+static int benchmark_path_count;
+
+/* Finds paths between random points in the instances around the first
+   one, and reports how many are found per second. Each path is asked
+   for twice, the second time straight after the first, so the rates
+   with and without the path cache can be told apart. */
+static enum Continue benchmark_paths(void) {
+    Area areas[MAX_PORTAL_COUNT + 1];
+    int area_count = get_benchmark_areas(areas);
+
+    struct Random* random = GetStream(RANDOM_MISCELLANEOUS);
+    static struct Path path;
+
+    int found_count = 0;
+    double search_time = 0, cached_time = 0;
+    for (int i=0; i<benchmark_path_count; i++) {
+	Area from_area = areas[RandomBelow(random, area_count)];
+	Area to_area = areas[RandomBelow(random, area_count)];
+	union Vector2 from = GetRandomNavmeshPoint(from_area, random);
+	union Vector2 to = GetRandomNavmeshPoint(to_area, random);
+
+	double start_time = GetPerformanceTime();
+	found_count += FindPath(from_area, from, to_area, to, &path);
+	double middle_time = GetPerformanceTime();
+	FindPath(from_area, from, to_area, to, &path);
+	double end_time = GetPerformanceTime();
+
+	search_time += middle_time - start_time;
+	cached_time += end_time - middle_time;
+    }
+
+    Log("Found %d of %d paths in %f seconds, which is %f paths per second\n",
+	found_count, benchmark_path_count, search_time, benchmark_path_count / search_time);
+    Log("Found them again from the cache in %f seconds, which is %f paths per second\n",
+	cached_time, benchmark_path_count / cached_time);
+
+    return UP;
+}
 
 int main(int rgc, char* argv[]) {
-    srand(SDL_GetPerformanceCounter());
-    
     {
 	if (got_flag(argv, "--version") == 1) {
 	    printf("TODO VERSION\n");
@@ -342,8 +670,21 @@ int main(int rgc, char* argv[]) {
     }
     
     LogVerbosely();
+
+    {
+	/* Seed from the clock, unless asked to reproduce a run or
+	   running headless */
+	if (got_ints(argv, "--seed", 1, &seed) == 1 || got_flag(argv, "--headless") == 1) {
+	    SeedStreams((u64)seed);
+	    Log("Seeding with %d\n", seed);
+	} else {
+	    SeedStreams(SDL_GetPerformanceCounter());
+	}
+    }
+
     Rung(RememberBasePath, NULL);
     Rung(init_sdl, quit_sdl);
+    Rung(StartWorkers, StopWorkers);
     Rung(set_gl_attributes, NULL);
     Rung(open_window, close_window);
 
@@ -356,11 +697,35 @@ int main(int rgc, char* argv[]) {
 	if (got_flag(argv, "--fullscreen") == 1) {
 	    FULLSCREEN = SDL_WINDOW_FULLSCREEN_DESKTOP;
 	}
+
+	if (got_flag(argv, "--batch-scenery") == 1) {
+	    BatchScenery(1);
+	}
+
+	if (got_flag(argv, "--headless") == 1) {
+	    headless = 1;
+	}
+
+	if (got_flag(argv, "--cull-portals") == 1) {
+	    CullPortals(1);
+	}
+
+	if (got_flag(argv, "--impostors") == 1) {
+	    use_impostors = 1;
+	}
+
+	int budget_milliseconds;
+	if (got_ints(argv, "--frame-budget", 1, &budget_milliseconds) == 1 && budget_milliseconds > 0) {
+	    frame_budget = budget_milliseconds / 1000.0;
+	}
     }
     
     Rung(create_gl_context, delete_gl_context);
     Rung(create_renderer, NULL);
     Rung(CreateAreaMeshes, NULL);
+    if (use_impostors) {
+	Rung(create_impostors, NULL);
+    }
 
     {
 	if (got_strings(argv, "--area", 1, &area_to_load) == 1) {
@@ -370,6 +735,27 @@ int main(int rgc, char* argv[]) {
 	}
     }
     
-    Rung(loop, NULL);
+    if (got_ints(argv, "--benchmark-agents", 1, &benchmark_agent_count) == 1) {
+	Rung(benchmark_agents, NULL);
+    } else if (got_ints(argv, "--benchmark-paths", 1, &benchmark_path_count) == 1 && benchmark_path_count > 0) {
+	Rung(benchmark_paths, NULL);
+    } else if (headless) {
+	if (got_ints(argv, "--frames", 1, &benchmark_frame_count) != 1 || benchmark_frame_count <= 0) {
+	    Err("Headless runs need a number of frames to draw, given with --frames\n");
+	    return 1;
+	}
+	got_strings(argv, "--csv", 1, &benchmark_csv_path);
+
+	Rung(load_textures, NULL);
+	Rung(spawn_player, NULL);
+	Rung(start_render_thread, stop_render_thread);
+	Rung(benchmark_frames, NULL);
+    } else {
+	Rung(load_textures, NULL);
+	Rung(spawn_player, NULL);
+	Rung(StartSimulation, StopSimulation);
+	Rung(start_render_thread, stop_render_thread);
+	Rung(loop, NULL);
+    }
     return Climb();
 }
@@ -411,6 +411,74 @@ union Matrix4 Perspective(f32 fov, f32 aspect, f32 near, f32 far) {
 }
 
 
+/* Replaces a perspective projection's near plane with `plane`, given
+   in view space and facing away from the camera, so anything between
+   the camera and the plane gets clipped. The far plane is skewed as
+   a result. See Lengyel, "Oblique View Frustum Depth Projection and
+   Clipping". */
+union Matrix4 ObliqueNearPlane(union Matrix4 m, union Vector4 plane) {
+    union Vector4 q;
+    q.x = (copysignf(1.0f, plane.x) + m.floats[8]) / m.floats[0];
+    q.y = (copysignf(1.0f, plane.y) + m.floats[9]) / m.floats[5];
+    q.z = -1.0f;
+    q.w = (1.0f + m.floats[10]) / m.floats[14];
+
+    f32 scale = 2.0f / (plane.x * q.x + plane.y * q.y + plane.z * q.z + plane.w * q.w);
+    m.floats[2] = plane.x * scale;
+    m.floats[6] = plane.y * scale;
+    m.floats[10] = plane.z * scale + 1.0f;
+    m.floats[14] = plane.w * scale;
+
+    return m;
+}
+
+
+/* Looks through the rectangle with the given corners as if it were a
+   window, so that it fills the whole of clip space and anything on
+   the eye's side of it is clipped. The result includes the view, and
+   depends only on where the eye is, not where it's looking. The
+   window has to face the eye. See Kooima, "Generalized Perspective
+   Projection". */
+union Matrix4 WindowPerspective(union Vector3 eye,
+                                union Vector3 lower_left,
+                                union Vector3 lower_right,
+                                union Vector3 upper_left,
+                                f32 far) {
+    union Vector3 across = Normalize3(Sub3(lower_right, lower_left));
+    union Vector3 up = Normalize3(Sub3(upper_left, lower_left));
+    union Vector3 normal = Normalize3(Cross3(across, up));
+
+    union Vector3 to_lower_left = Sub3(lower_left, eye);
+    f32 near = -Dot3(to_lower_left, normal);
+    f32 left = Dot3(across, to_lower_left);
+    f32 right = Dot3(across, Sub3(lower_right, eye));
+    f32 bottom = Dot3(up, to_lower_left);
+    f32 top = Dot3(up, Sub3(upper_left, eye));
+
+    union Matrix4 projection = Matrix4(0.0f);
+    projection.floats[0] = 2.0f * near / (right - left);
+    projection.floats[5] = 2.0f * near / (top - bottom);
+    projection.floats[8] = (right + left) / (right - left);
+    projection.floats[9] = (top + bottom) / (top - bottom);
+    projection.floats[10] = (near + far) / (near - far);
+    projection.floats[11] = -1.0f;
+    projection.floats[14] = (2.0f * near * far) / (near - far);
+
+    union Matrix4 basis = Matrix4(1.0f);
+    basis.columns[0][0] = across.x;
+    basis.columns[1][0] = across.y;
+    basis.columns[2][0] = across.z;
+    basis.columns[0][1] = up.x;
+    basis.columns[1][1] = up.y;
+    basis.columns[2][1] = up.z;
+    basis.columns[0][2] = normal.x;
+    basis.columns[1][2] = normal.y;
+    basis.columns[2][2] = normal.z;
+
+    return MulM4(projection, MulM4(basis, Translation(Negate3(eye))));
+}
+
+
 union Matrix4 Rotation(union Quaternion q) {
     q = NormalizeQ(q);
 
@@ -545,6 +613,124 @@ union Vector3 ToBarycentric3(union Vector3 p, union Vector3 a, union Vector3 b,
 }
 
 
+struct Bounds3 EmptyBounds3(void) {
+    return (struct Bounds3) {
+        .min=Vector3(INFINITY, INFINITY, INFINITY),
+        .max=Vector3(-INFINITY, -INFINITY, -INFINITY),
+        .center=Vector3(0, 0, 0),
+        .radius=0,
+    };
+}
+
+
+/* Grows the box, and refits the sphere loosely around it */
+void GrowBounds3(struct Bounds3* b, union Vector3 p) {
+    b->min = Vector3(fminf(b->min.x, p.x), fminf(b->min.y, p.y), fminf(b->min.z, p.z));
+    b->max = Vector3(fmaxf(b->max.x, p.x), fmaxf(b->max.y, p.y), fmaxf(b->max.z, p.z));
+    b->center = Scale3(Add3(b->min, b->max), 0.5f);
+    b->radius = Magnitude3(Sub3(b->max, b->center));
+}
+
+
+struct Bounds3 MergeBounds3(struct Bounds3 l, struct Bounds3 r) {
+    if (l.min.x > l.max.x) {
+        return r;
+    }
+    if (r.min.x > r.max.x) {
+        return l;
+    }
+
+    struct Bounds3 b = l;
+    b.min = Vector3(fminf(l.min.x, r.min.x), fminf(l.min.y, r.min.y), fminf(l.min.z, r.min.z));
+    b.max = Vector3(fmaxf(l.max.x, r.max.x), fmaxf(l.max.y, r.max.y), fmaxf(l.max.z, r.max.z));
+
+    union Vector3 offset = Sub3(r.center, l.center);
+    f32 distance = Magnitude3(offset);
+    if (distance + r.radius <= l.radius) {
+        return b;
+    }
+    if (distance + l.radius <= r.radius) {
+        b.center = r.center;
+        b.radius = r.radius;
+        return b;
+    }
+
+    b.radius = (distance + l.radius + r.radius) * 0.5f;
+    b.center = Add3(l.center, Scale3(offset, (b.radius - l.radius) / distance));
+    return b;
+}
+
+
+struct Bounds3 TransformBounds3(union Matrix4 m, struct Bounds3 b) {
+    if (b.min.x > b.max.x) {
+        return b;
+    }
+
+    struct Bounds3 t = EmptyBounds3();
+    for (int i=0; i<8; ++i) {
+        union Vector4 corner = Vector4((i & 1) ? b.max.x : b.min.x,
+                                       (i & 2) ? b.max.y : b.min.y,
+                                       (i & 4) ? b.max.z : b.min.z,
+                                       1);
+        GrowBounds3(&t, Transform4(m, corner).xyz);
+    }
+
+    /* The sphere only needs to grow by the largest scale */
+    f32 scale = 0;
+    for (int column=0; column<3; ++column) {
+        scale = fmaxf(scale, Magnitude3(m.vectors[column].xyz));
+    }
+    t.center = Transform4(m, Vector4(b.center.x, b.center.y, b.center.z, 1)).xyz;
+    t.radius = b.radius * scale;
+    return t;
+}
+
+
+/* The clip space of `clip`, narrowed down to a rectangle of
+   normalized device coordinates */
+struct Frustum Frustum(union Matrix4 clip, union Rect ndc) {
+    union Vector4 rows[4];
+    for (int row=0; row<4; ++row) {
+        rows[row] = Vector4(clip.columns[0][row], clip.columns[1][row],
+                            clip.columns[2][row], clip.columns[3][row]);
+    }
+
+    f32 left = ndc.x, right = ndc.x + ndc.width;
+    f32 bottom = ndc.y, top = ndc.y + ndc.height;
+
+    struct Frustum f;
+    for (int i=0; i<4; ++i) {
+        f.planes[0].floats[i] = rows[0].floats[i] - left * rows[3].floats[i];
+        f.planes[1].floats[i] = right * rows[3].floats[i] - rows[0].floats[i];
+        f.planes[2].floats[i] = rows[1].floats[i] - bottom * rows[3].floats[i];
+        f.planes[3].floats[i] = top * rows[3].floats[i] - rows[1].floats[i];
+        f.planes[4].floats[i] = rows[2].floats[i] + rows[3].floats[i];
+        f.planes[5].floats[i] = rows[3].floats[i] - rows[2].floats[i];
+    }
+    return f;
+}
+
+
+int OutsideFrustum(const struct Frustum* f, struct Bounds3 b) {
+    for (int i=0; i<6; ++i) {
+        union Vector4 plane = f->planes[i];
+
+        /* The sphere is cheaper to check, but the box is tighter */
+        if (Dot3(plane.xyz, b.center) + plane.w < -b.radius * Magnitude3(plane.xyz)) {
+            return 1;
+        }
+
+        union Vector3 farthest = Vector3((plane.x > 0) ? b.max.x : b.min.x,
+                                         (plane.y > 0) ? b.max.y : b.min.y,
+                                         (plane.z > 0) ? b.max.z : b.min.z);
+        if (Dot3(plane.xyz, farthest) + plane.w < 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
 const u8 hash[] = {
     151,160,137, 91, 90, 15,131, 13,201, 95, 96, 53,194,233,  7,225,
     140, 36,103, 30, 69,142,  8, 99, 37,240, 21, 10, 23,190,  6,148,
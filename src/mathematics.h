@@ -115,6 +115,8 @@ union Matrix4 LookAt(union Vector3 eye, union Vector3 target, union Vector3 up);
 union Matrix4 MulM4(union Matrix4 l, union Matrix4 r);
 union Matrix4 Orthographic(f32 left, f32 right, f32 bottom, f32 top, f32 near, f32 far);
 union Matrix4 Perspective(f32 fov, f32 aspect, f32 near, f32 far);
+union Matrix4 ObliqueNearPlane(union Matrix4 perspective, union Vector4 plane);
+union Matrix4 WindowPerspective(union Vector3 eye, union Vector3 lower_left, union Vector3 lower_right, union Vector3 upper_left, f32 far);
 union Matrix4 Rotation(union Quaternion q);
 union Matrix4 Scale(union Vector3 v);
 union Matrix4 Transformation(union Vector3 translation, union Quaternion rotation, union Vector3 scale);
@@ -163,6 +165,30 @@ union Vector3 FromBarycentric3(union Vector3 bary, union Vector3 a, union Vector
 union Vector3 ToBarycentric3(union Vector3, union Vector3 a, union Vector3 b, union Vector3 c);
 
 
+/* An axis-aligned box, and a sphere around its center */
+struct Bounds3 {
+    union Vector3 min, max;
+    union Vector3 center;
+    f32 radius;
+};
+
+
+struct Bounds3 EmptyBounds3(void);
+void GrowBounds3(struct Bounds3* bounds, union Vector3 point);
+struct Bounds3 MergeBounds3(struct Bounds3 l, struct Bounds3 r);
+struct Bounds3 TransformBounds3(union Matrix4 m, struct Bounds3 bounds);
+
+
+/* Planes facing inward, as (normal, distance) */
+struct Frustum {
+    union Vector4 planes[6];
+};
+
+
+struct Frustum Frustum(union Matrix4 clip, union Rect ndc);
+int OutsideFrustum(const struct Frustum* frustum, struct Bounds3 bounds);
+
+
 f32 Value1(f32 point);
 f32 Value2(union Vector2 point);
 f32 Voroni2(union Vector2 point, f32 scale);
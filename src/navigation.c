@@ -0,0 +1,475 @@
+#include "navigation.h"
+
+
+#include "logger.h"
+#include "SDL_plus.h"
+#include "workers.h"
+#include <string.h>
+
+
+/* Pathfinding happens in two passes. First, a coarse search over the
+   portal graph picks which areas to walk through, treating each area
+   as a single node. Then, A* runs over the navmesh cells of just
+   those areas, using the straight line distance through the rest of
+   the corridor as its heuristic. Both passes work in thread local
+   scratch space, so agents being stepped on different workers can
+   find paths at the same time, as long as nothing grows the world
+   meanwhile. */
+
+
+#define MAX_CORRIDOR_LENGTH 16
+
+
+struct Leg {
+    Area area;
+    union Vector2 entry;
+    int exit_portal_index;
+    union Vector2 exit;
+    /* Lower bound on the distance from this leg's exit to the goal */
+    float remaining;
+};
+
+
+static THREAD_LOCAL int corridor_length;
+static THREAD_LOCAL struct Leg corridor[MAX_CORRIDOR_LENGTH];
+
+
+static int find_corridor(Area from_area, union Vector2 from, Area to_area, union Vector2 to) {
+    if (from_area.id == to_area.id) {
+	corridor_length = 1;
+	corridor[0] = (struct Leg) { .area=from_area, .entry=from, .exit_portal_index=-1, .exit=to };
+	return 1;
+    }
+
+    /* Only instanced areas are linked to anything */
+    if (from_area.instance >= MAX_INSTANCED_AREA_COUNT || to_area.instance >= MAX_INSTANCED_AREA_COUNT) {
+	return 0;
+    }
+
+    static THREAD_LOCAL float distances[MAX_INSTANCED_AREA_COUNT];
+    static THREAD_LOCAL int settled[MAX_INSTANCED_AREA_COUNT];
+    static THREAD_LOCAL Area areas[MAX_INSTANCED_AREA_COUNT];
+    static THREAD_LOCAL union Vector2 entries[MAX_INSTANCED_AREA_COUNT];
+    static THREAD_LOCAL int previous[MAX_INSTANCED_AREA_COUNT];
+    static THREAD_LOCAL int previous_exits[MAX_INSTANCED_AREA_COUNT];
+
+    for (int i=0; i<MAX_INSTANCED_AREA_COUNT; i++) {
+	distances[i] = INFINITY;
+	settled[i] = 0;
+	previous[i] = -1;
+    }
+
+    distances[from_area.instance] = 0;
+    areas[from_area.instance] = from_area;
+    entries[from_area.instance] = from;
+
+    /* There are never more than a few dozen live instances, so a
+       linear scan for the nearest one is cheaper than a heap */
+    for (;;) {
+	int nearest = -1;
+	for (int i=0; i<MAX_INSTANCED_AREA_COUNT; i++) {
+	    if (!settled[i] && distances[i] < INFINITY
+		&& (nearest == -1 || distances[i] < distances[nearest])) {
+		nearest = i;
+	    }
+	}
+
+	if (nearest == -1) {
+	    return 0;
+	}
+	if (nearest == to_area.instance) {
+	    /* The goal's slot may have been retired and reused for some
+	       other area since the goal was picked */
+	    if (areas[nearest].id != to_area.id) {
+		return 0;
+	    }
+	    break;
+	}
+	settled[nearest] = 1;
+
+	Area area = areas[nearest];
+	for (int portal_index=0; portal_index<GetPortalCount(area); portal_index++) {
+	    Area destination;
+	    int destination_portal_index;
+	    if (!GetPortalLink(area, portal_index, &destination, &destination_portal_index)) {
+		continue;
+	    }
+
+	    float distance = distances[nearest]
+		+ Distance2(entries[nearest], GetPortalPosition(area, portal_index));
+	    if (!settled[destination.instance] && distance < distances[destination.instance]) {
+		distances[destination.instance] = distance;
+		areas[destination.instance] = destination;
+		entries[destination.instance] = GetPortalPosition(destination, destination_portal_index);
+		previous[destination.instance] = nearest;
+		previous_exits[destination.instance] = portal_index;
+	    }
+	}
+    }
+
+    /* Walk back from the goal to find out how long the corridor is,
+       then walk back again to fill it in */
+    int length = 1;
+    for (int i=to_area.instance; previous[i] != -1; i=previous[i]) {
+	length++;
+    }
+    if (length > MAX_CORRIDOR_LENGTH) {
+	return 0;
+    }
+
+    corridor_length = length;
+    corridor[length - 1] = (struct Leg) { .area=to_area,
+					  .entry=entries[to_area.instance],
+					  .exit_portal_index=-1,
+					  .exit=to,
+					  .remaining=0 };
+    int leg = length - 2;
+    for (int i=to_area.instance; previous[i] != -1; i=previous[i], leg--) {
+	int p = previous[i];
+	int exit_portal_index = previous_exits[i];
+	corridor[leg] = (struct Leg) { .area=areas[p],
+				       .entry=entries[p],
+				       .exit_portal_index=exit_portal_index,
+				       .exit=GetPortalPosition(areas[p], exit_portal_index) };
+    }
+
+    for (leg=length - 2; 0<=leg; leg--) {
+	struct Leg* next = &corridor[leg + 1];
+	corridor[leg].remaining = next->remaining + Distance2(next->entry, next->exit);
+    }
+
+    return 1;
+}
+
+
+#define MAX_NODE_COUNT (MAX_CORRIDOR_LENGTH * MAX_CELL_COUNT)
+
+
+struct Node {
+    float g, f;
+    int parent;
+    int parent_edge_index;
+    enum { UNVISITED, OPEN, CLOSED } state;
+};
+
+
+/* A node's pushed again whenever it's reached more cheaply, rather
+   than moved within the heap, which can happen once from each of the
+   three cells around it, besides the start */
+#define MAX_HEAP_COUNT (3 * MAX_NODE_COUNT + 1)
+
+
+static THREAD_LOCAL struct Node nodes[MAX_NODE_COUNT];
+static THREAD_LOCAL int heap_count;
+static THREAD_LOCAL int heap[MAX_HEAP_COUNT];
+
+
+static int heap_push(int node) {
+    if (heap_count >= MAX_HEAP_COUNT) {
+	Warn("Ran out of room to search for a path\n");
+	return 0;
+    }
+
+    int i = heap_count++;
+    while (i > 0) {
+	int parent = (i - 1) / 2;
+	if (nodes[heap[parent]].f <= nodes[node].f) {
+	    break;
+	}
+	heap[i] = heap[parent];
+	i = parent;
+    }
+    heap[i] = node;
+    return 1;
+}
+
+
+static int heap_pop(void) {
+    int top = heap[0];
+    int last = heap[--heap_count];
+    int i = 0;
+    for (;;) {
+	int child = 2 * i + 1;
+	if (child >= heap_count) {
+	    break;
+	}
+	if (child + 1 < heap_count && nodes[heap[child + 1]].f < nodes[heap[child]].f) {
+	    child++;
+	}
+	if (nodes[last].f <= nodes[heap[child]].f) {
+	    break;
+	}
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+
+static union Vector2 centroid(Area area, int cell_index) {
+    union Triangle3 t = GetCellTriangle(area, cell_index);
+    return Vector2((t.a.x + t.b.x + t.c.x) / 3.0f, (t.a.y + t.b.y + t.c.y) / 3.0f);
+}
+
+
+static union Vector2 edge_midpoint(Area area, int cell_index, int edge_index) {
+    union Triangle3 t = GetCellTriangle(area, cell_index);
+    return Scale2(Add2(t.p[edge_index].xy, t.p[(edge_index + 1) % 3].xy), 0.5f);
+}
+
+
+static float heuristic(int leg, union Vector2 position) {
+    return Distance2(position, corridor[leg].exit) + corridor[leg].remaining;
+}
+
+
+static int search_cells(int from_cell, union Vector2 from, int to_cell, struct Path* path) {
+    int node_count = corridor_length * MAX_CELL_COUNT;
+    for (int i=0; i<node_count; i++) {
+	nodes[i].state = UNVISITED;
+    }
+    heap_count = 0;
+
+    int start = from_cell;
+    int goal = (corridor_length - 1) * MAX_CELL_COUNT + to_cell;
+    nodes[start] = (struct Node) { .g=0, .f=heuristic(0, from), .parent=-1, .state=OPEN };
+    heap_push(start);
+
+    while (heap_count) {
+	int node = heap_pop();
+	if (nodes[node].state == CLOSED) {
+	    continue;
+	}
+	nodes[node].state = CLOSED;
+
+	if (node == goal) {
+	    break;
+	}
+
+	int leg = node / MAX_CELL_COUNT;
+	int cell_index = node % MAX_CELL_COUNT;
+	Area area = corridor[leg].area;
+	union Vector2 here = (node == start) ? from : centroid(area, cell_index);
+
+	for (int edge_index=0; edge_index<3; edge_index++) {
+	    Area neighbor_area;
+	    int neighbor_cell;
+	    if (!GetCellNeighbor(area, cell_index, edge_index, &neighbor_area, &neighbor_cell)) {
+		continue;
+	    }
+
+	    union Vector2 midpoint = edge_midpoint(area, cell_index, edge_index);
+	    float g = nodes[node].g + Distance2(here, midpoint);
+
+	    int neighbor_leg = leg;
+	    int portal_index = GetCellPortal(area, cell_index, edge_index);
+	    if (portal_index != -1) {
+		/* Only step through the portal the corridor goes through */
+		if (leg + 1 >= corridor_length || portal_index != corridor[leg].exit_portal_index) {
+		    continue;
+		}
+		neighbor_leg = leg + 1;
+		midpoint = corridor[neighbor_leg].entry;
+	    }
+
+	    /* The goal is costed to where we're actually going, since
+	       that's what the heuristic measures to on the last leg */
+	    int neighbor = neighbor_leg * MAX_CELL_COUNT + neighbor_cell;
+	    union Vector2 there = (neighbor == goal)
+		? corridor[corridor_length - 1].exit
+		: centroid(neighbor_area, neighbor_cell);
+	    g += Distance2(midpoint, there);
+
+	    if (nodes[neighbor].state == CLOSED
+		|| (nodes[neighbor].state == OPEN && nodes[neighbor].g <= g)) {
+		continue;
+	    }
+
+	    nodes[neighbor] = (struct Node) { .g=g,
+					      .f=g + heuristic(neighbor_leg, there),
+					      .parent=node,
+					      .parent_edge_index=edge_index,
+					      .state=OPEN };
+	    if (!heap_push(neighbor)) {
+		return 0;
+	    }
+	}
+    }
+
+    if (nodes[goal].state != CLOSED) {
+	return 0;
+    }
+
+    /* Count the edges crossed, then lay a waypoint on each of them */
+    int count = 1;
+    for (int node=goal; nodes[node].parent != -1; node=nodes[node].parent) {
+	count++;
+    }
+    if (count > MAX_WAYPOINT_COUNT) {
+	return 0;
+    }
+
+    path->waypoint_count = count;
+    int w = count - 1;
+    path->waypoints[w--] = (struct Waypoint) { .area=corridor[corridor_length - 1].area,
+					       .cell_index=to_cell,
+					       .position=corridor[corridor_length - 1].exit };
+    for (int node=goal; nodes[node].parent != -1; node=nodes[node].parent, w--) {
+	int parent = nodes[node].parent;
+	int parent_leg = parent / MAX_CELL_COUNT;
+	int parent_cell = parent % MAX_CELL_COUNT;
+	Area area = corridor[parent_leg].area;
+	path->waypoints[w] = (struct Waypoint) { .area=area,
+						 .cell_index=parent_cell,
+						 .position=edge_midpoint(area, parent_cell, nodes[node].parent_edge_index),
+						 .crosses_portal=(parent_leg != node / MAX_CELL_COUNT) };
+    }
+
+    return 1;
+}
+
+
+/* Recently found paths are kept around, since crowds tend to ask for
+   the same few routes over and over. Entries are keyed by start and
+   goal cell, and are thrown out whenever the world changes shape.
+   The cache is shared between threads, so it's only ever touched with
+   the lock held, while searching is done without it. */
+#define PATH_CACHE_SIZE 64
+
+
+struct CachedPath {
+    Area from_area, to_area;
+    int from_cell, to_cell;
+    u32 world_version;
+    u32 last_used;
+    int found;
+    struct Path path;
+};
+
+
+static SDL_SpinLock cache_lock = 0;
+static int cached_path_count = 0;
+static struct CachedPath cached_paths[PATH_CACHE_SIZE];
+static u32 cache_clock = 0;
+
+
+static struct CachedPath* find_cached_path(Area from_area, int from_cell, Area to_area, int to_cell) {
+    for (int i=0; i<cached_path_count; i++) {
+	struct CachedPath* c = &cached_paths[i];
+	if (c->from_area.id == from_area.id && c->from_cell == from_cell
+	    && c->to_area.id == to_area.id && c->to_cell == to_cell) {
+	    return c;
+	}
+    }
+    return NULL;
+}
+
+
+int FindPath(Area from_area, union Vector2 from, Area to_area, union Vector2 to, struct Path* path) {
+    path->waypoint_count = 0;
+
+    int from_cell = LocateCell(from_area, from);
+    int to_cell = LocateCell(to_area, to);
+    if (from_cell == -1 || to_cell == -1) {
+	return 0;
+    }
+
+    u32 world_version = GetWorldVersion();
+
+    SDL_AtomicLock(&cache_lock);
+    struct CachedPath* entry = find_cached_path(from_area, from_cell, to_area, to_cell);
+    if (entry && entry->world_version == world_version) {
+	entry->last_used = ++cache_clock;
+	int found = entry->found;
+	if (found) {
+	    *path = entry->path;
+	    /* The route is the same anywhere within the goal cell, but
+	       the last step isn't */
+	    path->waypoints[path->waypoint_count - 1].position = to;
+	}
+	SDL_AtomicUnlock(&cache_lock);
+	return found;
+    }
+    SDL_AtomicUnlock(&cache_lock);
+
+    int found = find_corridor(from_area, from, to_area, to)
+	&& search_cells(from_cell, from, to_cell, path);
+
+    /* Another thread may have cached the same route in the meantime.
+       Otherwise reuse a stale entry for it, or evict the least
+       recently used one. */
+    SDL_AtomicLock(&cache_lock);
+    entry = find_cached_path(from_area, from_cell, to_area, to_cell);
+    if (!entry) {
+	if (cached_path_count < PATH_CACHE_SIZE) {
+	    entry = &cached_paths[cached_path_count++];
+	} else {
+	    entry = &cached_paths[0];
+	    for (int i=1; i<PATH_CACHE_SIZE; i++) {
+		if (cached_paths[i].last_used < entry->last_used) {
+		    entry = &cached_paths[i];
+		}
+	    }
+	}
+    }
+
+    entry->from_area = from_area;
+    entry->from_cell = from_cell;
+    entry->to_area = to_area;
+    entry->to_cell = to_cell;
+    entry->world_version = world_version;
+    entry->last_used = ++cache_clock;
+    entry->found = found;
+    if (found) {
+	entry->path = *path;
+    }
+    SDL_AtomicUnlock(&cache_lock);
+
+    return found;
+}
+
+
+#define ARRIVAL_RADIUS 0.25f
+
+
+/* Which way to head to follow `waypoints`, which may be a whole path
+   or just the next few steps of one. `progress` is how many have been
+   reached so far, and it's all of them once there's nowhere left to
+   head. */
+union Vector2 SteerAlongPath(const struct Waypoint waypoints[], int waypoint_count, int* progress,
+			     Area area, union Vector2 position) {
+    while (*progress < waypoint_count) {
+	const struct Waypoint* waypoint = &waypoints[*progress];
+
+	if (waypoint->area.id != area.id) {
+	    /* We've stepped through a portal, so pick up from the first
+	       waypoint in the area we're in now */
+	    int next = *progress + 1;
+	    while (next < waypoint_count && waypoints[next].area.id != area.id) {
+		next++;
+	    }
+	    if (next == waypoint_count) {
+		/* We've wandered off the path entirely */
+		*progress = waypoint_count;
+		return Vector2(0, 0);
+	    }
+	    *progress = next;
+	    continue;
+	}
+
+	if (DistanceSquared2(position, waypoint->position) < ARRIVAL_RADIUS * ARRIVAL_RADIUS) {
+	    if (waypoint->crosses_portal) {
+		/* Keep pushing out through the portal until we're on
+		   the other side of it */
+		return DirectionFrom2(centroid(area, waypoint->cell_index), waypoint->position);
+	    }
+	    (*progress)++;
+	    continue;
+	}
+
+	return DirectionFrom2(position, waypoint->position);
+    }
+
+    return Vector2(0, 0);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+
+#include "area.h"
+#include "mathematics.h"
+
+
+#define MAX_WAYPOINT_COUNT 128
+
+
+struct Waypoint {
+    Area area;
+    int cell_index;
+    union Vector2 position;
+    /* Reaching this waypoint means stepping through a portal into the
+       next waypoint's area */
+    int crosses_portal;
+};
+
+
+struct Path {
+    int waypoint_count;
+    struct Waypoint waypoints[MAX_WAYPOINT_COUNT];
+};
+
+
+int FindPath(Area from_area, union Vector2 from, Area to_area, union Vector2 to, struct Path* path);
+union Vector2 SteerAlongPath(const struct Waypoint waypoints[], int waypoint_count, int* progress,
+			     Area area, union Vector2 position);
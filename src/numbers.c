@@ -1,7 +1,7 @@
 #include "numbers.h"
 
 
-#include <stdlib.h>
+#include "random.h"
 
 
 f32 to_radians(f32 degrees) {
@@ -26,7 +26,7 @@ f32 lerpf(f32 a, f32 b, f32 f) {
 
 
 f32 randf(f32 min, f32 max) {
-    return ((f32) rand() / (f32) RAND_MAX) * (max - min) + min;
+    return RandomFloat(GetStream(RANDOM_MISCELLANEOUS)) * (max - min) + min;
 }
 
 
@@ -20,6 +20,9 @@ typedef int16_t i16;
 typedef int32_t i32;
 #define I32_MIN INT32_MIN
 #define I32_MAX INT32_MAX
+typedef int64_t i64;
+#define I64_MIN INT64_MIN
+#define I64_MAX INT64_MAX
 
 
 typedef uint8_t u8;
@@ -29,6 +32,8 @@ typedef uint16_t u16;
 #define U24_MAX 0xFFFFFF
 typedef uint32_t u32;
 #define U32_MAX UINT32_MAX
+typedef uint64_t u64;
+#define U64_MAX UINT64_MAX
 
 
 typedef float f32;
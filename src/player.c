@@ -39,17 +39,114 @@ void PlayerWalkabout(float delta_time) {
     union Vector2 goal = Transform4(InvertM4(yaw_matrix),
 				    Vector4(move.x, move.y, 0, 1)).xy;
 
-    MoveAgent(player, goal, delta_time);
+    SetAgentGoal(player, goal, GetMoveScalar());
 }
 
 
-union Matrix4 GetPlayerView(void) {
-    return MulM4(MulM4(Rotation(AxisAngle(Vector3(1, 0, 0), to_radians(pitch))),
-		       MulM4(GetAgentRotation(player),
-			     Rotation(AxisAngle(Vector3(0, 0, 1), to_radians(yaw))))),
-		 InvertM4(Translation(Add3(GetAgentPosition(player),
-					   Vector3(0, 0, EYE_HEIGHT)))));
+/* The flythrough heads for one portal after another, picked at random
+   but never back the way it came unless there's nowhere else to go.
+   If it hasn't got anywhere in a while, it's probably stuck against a
+   wall, and picks again from all of them. */
+#define FLYTHROUGH_PATIENCE 10.0f
+
+
+static Area flythrough_area = { .id=U32_MAX };
+static int flythrough_portal = -1;
+static int flythrough_entry = -1;
+static int flythrough_next_entry = -1;
+static float flythrough_time = 0;
+
+
+static void pick_flythrough_portal(Area area, struct Random* random) {
+    int candidates[MAX_PORTAL_COUNT];
+    int destination_portals[MAX_PORTAL_COUNT];
+    int candidate_count = 0;
+    for (int portal_index=0; portal_index<GetPortalCount(area); portal_index++) {
+	Area destination;
+	if (portal_index != flythrough_entry
+	    && GetPortalLink(area, portal_index, &destination, &destination_portals[candidate_count])) {
+	    candidates[candidate_count++] = portal_index;
+	}
+    }
+
+    if (candidate_count) {
+	int i = RandomBelow(random, candidate_count);
+	flythrough_portal = candidates[i];
+	flythrough_next_entry = destination_portals[i];
+    } else {
+	flythrough_portal = flythrough_entry;
+	flythrough_next_entry = -1;
+    }
+    flythrough_time = 0;
+}
+
+
+void PlayerFlythrough(float delta_time, struct Random* random) {
+    Area area = GetAgentArea(player);
+    if (area.id != flythrough_area.id) {
+	flythrough_entry = (flythrough_area.id == U32_MAX) ? -1 : flythrough_next_entry;
+	flythrough_area = area;
+	pick_flythrough_portal(area, random);
+    }
+
+    flythrough_time += delta_time;
+    if (flythrough_time > FLYTHROUGH_PATIENCE) {
+	flythrough_entry = -1;
+	pick_flythrough_portal(area, random);
+    }
+    if (flythrough_portal < 0) {
+	return;
+    }
+
+    union Vector2 goal = Sub2(GetPortalPosition(area, flythrough_portal), GetAgentPosition(player).xy);
+    SetAgentGoal(player, goal, 1.0f);
+
+    /* Look level, straight where we're headed */
+    pitch = -90.0f;
+    yaw = to_degrees(atan2f(goal.x, goal.y) - GetAgentHeading(player));
+}
+
+
+struct Viewpoint GetPlayerViewpoint(void) {
+    return (struct Viewpoint) {
+	.area=GetAgentArea(player),
+	.cell_index=GetAgentCell(player),
+	.position=Add3(GetAgentPosition(player), Vector3(0, 0, EYE_HEIGHT)),
+	.pitch=to_radians(pitch),
+	.yaw=GetAgentHeading(player) + to_radians(yaw),
+    };
+}
 
+
+struct Viewpoint LerpViewpoint(struct Viewpoint a, struct Viewpoint b, float f) {
+    /* Positions in different areas can't be compared, so snap to the
+       newer one when the player steps through a portal */
+    if (a.area.id != b.area.id) {
+	return b;
+    }
+
+    /* In between two cells, the view could be from either */
+    return (struct Viewpoint) {
+	.area=b.area,
+	.cell_index=(a.cell_index == b.cell_index) ? b.cell_index : -1,
+	.position=Vector3(lerpf(a.position.x, b.position.x, f),
+			  lerpf(a.position.y, b.position.y, f),
+			  lerpf(a.position.z, b.position.z, f)),
+	.pitch=lerpf(a.pitch, b.pitch, f),
+	.yaw=lerpf(a.yaw, b.yaw, f),
+    };
+}
+
+
+union Matrix4 GetViewpointView(struct Viewpoint viewpoint) {
+    return MulM4(MulM4(Rotation(AxisAngle(Vector3(1, 0, 0), viewpoint.pitch)),
+		       Rotation(AxisAngle(Vector3(0, 0, 1), viewpoint.yaw))),
+		 InvertM4(Translation(viewpoint.position)));
+}
+
+
+union Matrix4 GetPlayerView(void) {
+    return GetViewpointView(GetPlayerViewpoint());
 }
 
 
@@ -2,10 +2,25 @@
 
 
 #include "area.h"
+#include "random.h"
+
+
+/* Everything needed to see from where the player stands, without
+   reaching back into the agent that's standing there */
+struct Viewpoint {
+    Area area;
+    int cell_index;
+    union Vector3 position;
+    float pitch, yaw;
+};
 
 
 void SpawnPlayer(Area area);
 void PlayerWalkabout(float delta_time);
+void PlayerFlythrough(float delta_time, struct Random* random);
+struct Viewpoint GetPlayerViewpoint(void);
+struct Viewpoint LerpViewpoint(struct Viewpoint a, struct Viewpoint b, float f);
+union Matrix4 GetViewpointView(struct Viewpoint viewpoint);
 union Matrix4 GetPlayerView(void);
 void DrawPlayer(float radius);
 Area GetPlayerArea(void);
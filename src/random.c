@@ -0,0 +1,117 @@
+#include "random.h"
+
+
+static u64 splitmix64(u64* x) {
+    u64 z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+
+struct Random SeedRandom(u64 seed) {
+    /* Expand the seed with splitmix64, as recommended by the authors
+       of xoshiro, so that similar seeds give unrelated streams */
+    struct Random random;
+    u64 a = splitmix64(&seed);
+    u64 b = splitmix64(&seed);
+    random.state[0] = (u32)a;
+    random.state[1] = (u32)(a >> 32);
+    random.state[2] = (u32)b;
+    random.state[3] = (u32)(b >> 32);
+    return random;
+}
+
+
+static u32 rotl(const u32 x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+
+u32 NextRandom(struct Random* random) {
+    u32* s = random->state;
+    const u32 result = rotl(s[1] * 5, 7) * 9;
+    const u32 t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+
+    s[2] ^= t;
+
+    s[3] = rotl(s[3], 11);
+
+    return result;
+}
+
+
+struct Random SplitRandom(struct Random* random) {
+    /* The child stream continues from where the parent is, and the
+       parent jumps 2^64 draws ahead, so the two never overlap */
+    static const u32 JUMP[] = { 0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b };
+
+    struct Random child = *random;
+
+    u32 s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i=0; i<4; i++) {
+	for (int b=0; b<32; b++) {
+	    if (JUMP[i] & (u32)1 << b) {
+		s0 ^= random->state[0];
+		s1 ^= random->state[1];
+		s2 ^= random->state[2];
+		s3 ^= random->state[3];
+	    }
+	    NextRandom(random);
+	}
+    }
+
+    random->state[0] = s0;
+    random->state[1] = s1;
+    random->state[2] = s2;
+    random->state[3] = s3;
+
+    return child;
+}
+
+
+u32 RandomBelow(struct Random* random, u32 bound) {
+    /* Lemire's nearly divisionless method, which avoids the modulo
+       bias of `NextRandom(random) % bound` */
+    if (bound == 0) {
+	return 0;
+    }
+
+    u64 m = (u64)NextRandom(random) * (u64)bound;
+    u32 l = (u32)m;
+    if (l < bound) {
+	u32 t = -bound % bound;
+	while (l < t) {
+	    m = (u64)NextRandom(random) * (u64)bound;
+	    l = (u32)m;
+	}
+    }
+    return (u32)(m >> 32);
+}
+
+
+f32 RandomFloat(struct Random* random) {
+    /* Use the top 24 bits, which is all the precision a float has */
+    return (f32)(NextRandom(random) >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static struct Random streams[RANDOM_STREAM_COUNT];
+
+
+void SeedStreams(u64 seed) {
+    struct Random root = SeedRandom(seed);
+    for (int i=0; i<RANDOM_STREAM_COUNT; i++) {
+	streams[i] = SplitRandom(&root);
+    }
+}
+
+
+struct Random* GetStream(enum RandomStream stream) {
+    return &streams[stream];
+}
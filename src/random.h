@@ -0,0 +1,39 @@
+#pragma once
+
+
+#include "numbers.h"
+
+
+/* A xoshiro128** generator. Each stream owns its state outright, so
+   threads can draw from their own streams without contention. */
+struct Random {
+    u32 state[4];
+};
+
+
+struct Random SeedRandom(u64 seed);
+struct Random SplitRandom(struct Random* random);
+
+
+u32 NextRandom(struct Random* random);
+u32 RandomBelow(struct Random* random, u32 bound);
+f32 RandomFloat(struct Random* random);
+
+
+/* Every stream belongs to one thread, and only that thread may draw
+   from it. The world and agents belong to whichever thread runs the
+   simulation, and the rest to the main thread. Anything that needs
+   random numbers from jobs should carry its own stream, split off one
+   of these, rather than share one between workers; which worker runs
+   which job isn't up to us, so a stream per worker wouldn't give the
+   same numbers twice for the same seed. */
+enum RandomStream {
+    RANDOM_WORLD,
+    RANDOM_AGENTS,
+    RANDOM_MISCELLANEOUS,
+    RANDOM_STREAM_COUNT,
+};
+
+
+void SeedStreams(u64 seed);
+struct Random* GetStream(enum RandomStream stream);
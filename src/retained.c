@@ -3,24 +3,49 @@
 
 #include "logger.h"
 #include "SDL_plus.h"
+#include <stdio.h>
 
 
 struct String_GLuint64_Pair {
     char key[48];
     GLuint64 value;
+    GLuint64 lods[MAX_MESH_LOD_COUNT];
+    struct Bounds3 bounds;
 };
 
 
 #define MAX_KV_COUNT 512
 static int kv_count = 0;
+static int kv_with_lods_count = 0;
 static struct String_GLuint64_Pair kvs[MAX_KV_COUNT];
 
 
-GLuint64 rtLoadMeshAsset(const char* name) {
+/* Simplified levels are cooked alongside a mesh as `name.lod1.mesh`
+   and so on. Where one is missing, the level before stands in. */
+static void load_lods(struct String_GLuint64_Pair* kv) {
+    for (int level=1; level<MAX_MESH_LOD_COUNT; level++) {
+	char filepath[128];
+	snprintf(filepath, sizeof(filepath), "assets/meshes/%s.lod%d.mesh", kv->key, level);
+	const char* lod_filepath = FromBase(filepath);
+
+	/* A level that doesn't fit falls back to the one before it */
+	kv->lods[level] = 0;
+	FILE* f = fopen(lod_filepath, "rb");
+	if (f) {
+	    fclose(f);
+	    kv->lods[level] = rtLoadMesh(lod_filepath, NULL);
+	}
+	if (!kv->lods[level]) {
+	    kv->lods[level] = kv->lods[level - 1];
+	}
+    }
+}
+
+
+static struct String_GLuint64_Pair* load_mesh_asset(const char* name) {
     for (int i=0; i<kv_count; i += 1) {
-	struct String_GLuint64_Pair kv = kvs[i];
-	if (strcmp(kv.key, name) == 0) {
-	    return kv.value;
+	if (strcmp(kvs[i].key, name) == 0) {
+	    return &kvs[i];
 	}
     }
 
@@ -31,10 +56,49 @@ GLuint64 rtLoadMeshAsset(const char* name) {
 	char filepath[128] = "assets/meshes/";
 	strcat(filepath, name);
 	strcat(filepath, ".mesh");
-	kv->value = rtLoadMesh(FromBase(filepath));
-	return kv->value;
+	kv->bounds = EmptyBounds3();
+	kv->value = rtLoadMesh(FromBase(filepath), &kv->bounds);
+	for (int level=0; level<MAX_MESH_LOD_COUNT; level++) {
+	    kv->lods[level] = kv->value;
+	}
+	return kv;
     } else {
 	Warn("Unable to load any more meshes\n");
+	return NULL;
+    }
+}
+
+
+GLuint64 rtLoadMeshAsset(const char* name, struct Bounds3* bounds) {
+    struct String_GLuint64_Pair* kv = load_mesh_asset(name);
+    if (!kv) {
 	return 0;
     }
+
+    if (bounds) {
+	*bounds = kv->bounds;
+    }
+    return kv->value;
+}
+
+
+const GLuint64* rtLoadMeshAssetLods(const char* name) {
+    static const GLuint64 no_lods[MAX_MESH_LOD_COUNT] = { 0 };
+    struct String_GLuint64_Pair* kv = load_mesh_asset(name);
+    return kv ? kv->lods : no_lods;
+}
+
+
+void rtLoadMeshLods(void) {
+    for (; kv_with_lods_count<kv_count; kv_with_lods_count++) {
+	load_lods(&kvs[kv_with_lods_count]);
+    }
+}
+
+
+int rtAppendMeshAsset(const char* name, union Matrix4 transform) {
+    char filepath[128] = "assets/meshes/";
+    strcat(filepath, name);
+    strcat(filepath, ".mesh");
+    return rtAppendMesh(FromBase(filepath), transform);
 }
@@ -3,12 +3,29 @@
 
 #include "GL_plus.h"
 #include "mathematics.h"
+#include "SDL_plus.h"
 
 
-GLuint64 rtLoadMeshAsset(const char* filepath);
+/* Meshes are loaded once, and their bounds are kept alongside. Level 0
+   of a mesh's levels of detail is the mesh itself, and the bounds are
+   its bounds. The simplified levels only load once rtLoadMeshLods is
+   called, after every mesh they'd share the vertex stream with, so
+   that running out of room drops levels of detail rather than meshes;
+   until then, and wherever they don't fit, the mesh stands in. The
+   levels returned are updated in place. */
+#define MAX_MESH_LOD_COUNT 3
+GLuint64 rtLoadMeshAsset(const char* name, struct Bounds3* bounds);
+const GLuint64* rtLoadMeshAssetLods(const char* name);
+void rtLoadMeshLods(void);
 
 
-GLuint64 rtLoadMesh(const char* filepath);
+GLuint64 rtLoadMesh(const char* filepath, struct Bounds3* bounds);
+
+
+/* These add a mesh's vertices, moved by `transform`, to the mesh
+   being recorded between rtBegin and rtEnd */
+int rtAppendMeshAsset(const char* name, union Matrix4 transform);
+int rtAppendMesh(const char* filepath, union Matrix4 transform);
 
 
 GLuint64 rtGenVertexArray(void);
@@ -28,3 +45,11 @@ void rtFillBuffer(void);
 
 
 void rtFlush(void);
+
+
+int rtStartRenderThread(SDL_Window* window, SDL_GLContext context);
+void rtStopRenderThread(void);
+void rtPresent(void);
+struct GLStateCounters rtGetFrameCounters(void);
+double rtGetFrameReplayTime(void);
+double rtGetFrameGPUTime(u64 frame);
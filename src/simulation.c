@@ -0,0 +1,125 @@
+#include "simulation.h"
+
+
+#include "events.h"
+#include "logger.h"
+#include "SDL_plus.h"
+
+
+/* Frames that take longer than this don't get caught up on */
+#define MAX_LAG 0.25
+
+
+/* The renderer changes how deep it draws as it goes, so how far ahead
+   the world is grown can change under us */
+static SDL_atomic_t world_depth;
+static SDL_Thread* thread = NULL;
+static SDL_atomic_t stopping;
+
+
+/* Snapshots rotate through three buffers. The simulation fills in the
+   back one by itself, and only takes the lock to rotate it to the
+   front, so neither side ever waits on the other for long. */
+static SDL_mutex* snapshot_lock = NULL;
+static struct Snapshot snapshots[3];
+static struct Snapshot* previous_snapshot = &snapshots[0];
+static struct Snapshot* current_snapshot = &snapshots[1];
+static struct Snapshot* back_snapshot = &snapshots[2];
+
+
+static void publish_snapshot(u32 tick) {
+    back_snapshot->tick = tick;
+    back_snapshot->player = GetPlayerViewpoint();
+    CopyLinkTable(&back_snapshot->links);
+    back_snapshot->published_at = GetPerformanceTime();
+
+    SDL_LockMutex(snapshot_lock);
+    struct Snapshot* oldest = previous_snapshot;
+    previous_snapshot = current_snapshot;
+    current_snapshot = back_snapshot;
+    back_snapshot = oldest;
+    SDL_UnlockMutex(snapshot_lock);
+}
+
+
+static int simulate(void* data) {
+    u32 tick = 0;
+    double next_tick_time = GetPerformanceTime();
+
+    while (!SDL_AtomicGet(&stopping)) {
+	double time = GetPerformanceTime();
+	if (time < next_tick_time) {
+	    SDL_Delay((Uint32)((next_tick_time - time) * 1000.0));
+	    continue;
+	}
+	if (time - next_tick_time > MAX_LAG) {
+	    next_tick_time = time;
+	}
+
+	ConsumeInputs();
+	PlayerWalkabout(TICK_DURATION);
+	StepAgents(TICK_DURATION);
+	GrowWorld(GetPlayerArea(), SDL_AtomicGet(&world_depth));
+
+	publish_snapshot(++tick);
+	next_tick_time += TICK_DURATION;
+    }
+
+    return 0;
+}
+
+
+void SetSimulationDepth(int depth) {
+    SDL_AtomicSet(&world_depth, depth);
+}
+
+
+enum Continue StartSimulation(void) {
+    snapshot_lock = SDL_CreateMutex();
+    if (!snapshot_lock) {
+	Err("Unable to create the snapshot lock because %s\n", SDL_GetError());
+	return DOWN;
+    }
+
+    /* Start out with something to show before the first tick */
+    publish_snapshot(0);
+    publish_snapshot(0);
+
+    SDL_AtomicSet(&stopping, 0);
+    thread = SDL_CreateThread(simulate, "simulation", NULL);
+    if (!thread) {
+	Err("Unable to create the simulation thread because %s\n", SDL_GetError());
+	return DOWN;
+    }
+
+    return UP;
+}
+
+
+void StopSimulation(void) {
+    if (thread) {
+	SDL_AtomicSet(&stopping, 1);
+	SDL_WaitThread(thread, NULL);
+	thread = NULL;
+    }
+    if (snapshot_lock) {
+	SDL_DestroyMutex(snapshot_lock);
+	snapshot_lock = NULL;
+    }
+}
+
+
+void ReadSnapshots(struct Snapshot* previous, struct Snapshot* current) {
+    SDL_LockMutex(snapshot_lock);
+    *previous = *previous_snapshot;
+    *current = *current_snapshot;
+    SDL_UnlockMutex(snapshot_lock);
+}
+
+
+/* How far between the previous snapshot and the current one to draw.
+   The renderer runs a tick behind, so that it's always got two
+   snapshots to interpolate between. */
+float GetSnapshotAlpha(const struct Snapshot* current) {
+    return clampf(0.0f, (GetPerformanceTime() - current->published_at) / TICK_DURATION, 1.0f);
+}
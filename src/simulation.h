@@ -0,0 +1,30 @@
+#pragma once
+
+
+#include "area.h"
+#include "ladder.h"
+#include "player.h"
+
+
+#define TICK_RATE 30
+#define TICK_DURATION (1.0 / TICK_RATE)
+
+
+/* What the renderer gets to see of a single tick. The simulation
+   thread publishes one of these after every tick, and keeps the one
+   before it around so the renderer can interpolate between them. */
+struct Snapshot {
+    u32 tick;
+    double published_at;
+    struct Viewpoint player;
+    struct LinkTable links;
+};
+
+
+void SetSimulationDepth(int depth);
+enum Continue StartSimulation(void);
+void StopSimulation(void);
+
+
+void ReadSnapshots(struct Snapshot* previous, struct Snapshot* current);
+float GetSnapshotAlpha(const struct Snapshot* current);
@@ -0,0 +1,137 @@
+#include "workers.h"
+
+
+#include "logger.h"
+#include <stdint.h>
+
+
+static int thread_count = 0;
+static SDL_Thread* threads[MAX_WORKER_COUNT];
+static SDL_sem* wake;
+static SDL_sem* done;
+static SDL_atomic_t quitting;
+/* Held by whichever thread's batch is running */
+static SDL_mutex* batch_lock;
+
+
+static struct {
+    Job job;
+    void* data;
+    int job_count;
+    SDL_atomic_t next_job_index;
+} batch;
+
+
+static void run_batch(int worker_index) {
+    int job_index;
+    while ((job_index = SDL_AtomicAdd(&batch.next_job_index, 1)) < batch.job_count) {
+	batch.job(job_index, worker_index, batch.data);
+    }
+}
+
+
+static int work(void* data) {
+    int worker_index = (int)(intptr_t)data;
+
+    for (;;) {
+	SDL_SemWait(wake);
+	if (SDL_AtomicGet(&quitting)) {
+	    break;
+	}
+	run_batch(worker_index);
+	SDL_SemPost(done);
+    }
+
+    return 0;
+}
+
+
+enum Continue StartWorkers(void) {
+    wake = SDL_CreateSemaphore(0);
+    done = SDL_CreateSemaphore(0);
+    batch_lock = SDL_CreateMutex();
+    if (!wake || !done || !batch_lock) {
+	Err("Unable to create worker semaphores because %s\n", SDL_GetError());
+	return DOWN;
+    }
+
+    SDL_AtomicSet(&quitting, 0);
+
+    int wanted_count = SDL_GetCPUCount() - 1;
+    if (wanted_count > MAX_WORKER_COUNT - 1) {
+	wanted_count = MAX_WORKER_COUNT - 1;
+    }
+
+    for (thread_count=0; thread_count<wanted_count; thread_count++) {
+	threads[thread_count] = SDL_CreateThread(work, "worker", (void*)(intptr_t)(thread_count + 1));
+	if (!threads[thread_count]) {
+	    /* We can get by with however many threads we managed */
+	    Warn("Unable to create a worker thread because %s\n", SDL_GetError());
+	    break;
+	}
+    }
+
+    Log("Running jobs on %d threads\n", thread_count + 1);
+
+    return UP;
+}
+
+
+void StopWorkers(void) {
+    SDL_AtomicSet(&quitting, 1);
+    for (int i=0; i<thread_count; i++) {
+	SDL_SemPost(wake);
+    }
+    for (int i=0; i<thread_count; i++) {
+	SDL_WaitThread(threads[i], NULL);
+    }
+    thread_count = 0;
+
+    SDL_DestroySemaphore(wake);
+    SDL_DestroySemaphore(done);
+    SDL_DestroyMutex(batch_lock);
+}
+
+
+int GetWorkerCount(void) {
+    return thread_count + 1;
+}
+
+
+static void run_jobs_here(int job_count, Job job, void* data) {
+    for (int job_index=0; job_index<job_count; job_index++) {
+	job(job_index, 0, data);
+    }
+}
+
+
+void RunJobs(int job_count, Job job, void* data) {
+    if (thread_count == 0 || job_count <= 1) {
+	run_jobs_here(job_count, job, data);
+	return;
+    }
+
+    /* More than one thread hands out jobs, so if the workers are busy
+       with someone else's we'd rather just get on with ours */
+    if (SDL_TryLockMutex(batch_lock) != 0) {
+	run_jobs_here(job_count, job, data);
+	return;
+    }
+
+    batch.job = job;
+    batch.data = data;
+    batch.job_count = job_count;
+    SDL_AtomicSet(&batch.next_job_index, 0);
+
+    /* The semaphores order the writes above before any worker reads
+       them, and every job's writes before we return */
+    for (int i=0; i<thread_count; i++) {
+	SDL_SemPost(wake);
+    }
+    run_batch(0);
+    for (int i=0; i<thread_count; i++) {
+	SDL_SemWait(done);
+    }
+
+    SDL_UnlockMutex(batch_lock);
+}
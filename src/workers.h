@@ -0,0 +1,29 @@
+#pragma once
+
+
+#include "ladder.h"
+
+
+/* A fixed pool of threads that run batches of independent jobs. The
+   thread calling RunJobs pitches in as worker 0. If the pool is
+   already busy with another thread's batch, the caller runs all of
+   its jobs by itself, so two threads can both be worker 0 at once. */
+#define MAX_WORKER_COUNT 16
+
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+
+typedef void (*Job)(int job_index, int worker_index, void* data);
+
+
+enum Continue StartWorkers(void);
+void StopWorkers(void);
+
+
+int GetWorkerCount(void);
+void RunJobs(int job_count, Job job, void* data);
@@ -323,6 +323,7 @@ def export_data(cooked_dir, data):
     for name, mesh_ in data["meshes"].items():
         print("Exporting {} ... ".format(name), end="")
         mesh.export_mesh(mesh_, os.path.join(dirname, name + ".mesh"))
+        mesh.export_lods(mesh_, os.path.join(dirname, name + ".mesh"))
         print("Done!")
 
 
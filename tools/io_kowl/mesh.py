@@ -1,4 +1,12 @@
 import bmesh
+import bpy
+import os
+
+
+# Each simplified level keeps about this fraction of the full mesh's
+# triangles. These must be kept in sync with `MAX_MESH_LOD_COUNT` in
+# `retained.h`, which counts the full mesh as well.
+LOD_RATIOS = (0.5, 0.2)
 
 
 def export_mesh(mesh, filepath):
@@ -7,6 +15,31 @@ def export_mesh(mesh, filepath):
     write_data(v, filepath)
 
 
+def export_lods(mesh, filepath):
+    base, ext = os.path.splitext(filepath)
+    for level, ratio in enumerate(LOD_RATIOS, start=1):
+        lod = decimate(mesh, ratio)
+        v = gather_vertices(lod)
+        bpy.data.meshes.remove(lod)
+        write_data(v, "{}.lod{}{}".format(base, level, ext))
+
+
+def decimate(mesh, ratio):
+    # Modifiers only apply to objects, so the mesh is borrowed by one
+    # just long enough to evaluate a decimated copy
+    obj = bpy.data.objects.new("lod", mesh)
+    bpy.context.scene.collection.objects.link(obj)
+    modifier = obj.modifiers.new("decimate", 'DECIMATE')
+    modifier.decimate_type = 'COLLAPSE'
+    modifier.ratio = ratio
+    modifier.use_collapse_triangulate = True
+
+    depsgraph = bpy.context.evaluated_depsgraph_get()
+    lod = bpy.data.meshes.new_from_object(obj.evaluated_get(depsgraph))
+    bpy.data.objects.remove(obj)
+    return lod
+
+
 def gather_vertices(mesh):
     bm = bmesh.new()
     bm.from_mesh(mesh)